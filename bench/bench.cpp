@@ -0,0 +1,605 @@
+// polyloc_bench: ns/op, bytes/s and allocations of polylocale against the native C library
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cwchar>
+#include <locale>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "polylocale.h"
+#include "polyformat.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <locale.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_USELOCALE
+#define HAVE_DUP2
+#endif
+
+// counts allocations, so polylocale's (and the baselines' std::string/streams) show up
+static std::atomic<size_t> g_allocs{ 0 };
+
+#ifdef __GLIBC__
+// glibc lets the program replace malloc, so the malloc family is counted too
+// (buffer_sink, poly_asprintf_l, poly_buffer...), operator new included as it calls malloc
+#define HAVE_MALLOC_COUNT
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+void __libc_free(void* p);
+
+void* malloc(size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+void free(void* p) { __libc_free(p); }
+}
+#endif // __GLIBC__
+
+// only C++ allocations can be counted elsewhere, so the column isn't shown there
+void* operator new(size_t size)
+{
+    if (auto p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace
+{
+
+volatile size_t g_sink; // keeps results alive
+
+struct measurement
+{
+    double ns_per_op;
+    double bytes_per_op;
+    double allocs_per_op;
+};
+
+// runs 'f' in batches until at least 'min_time' has passed.
+// 'f' returns the num. of bytes it wrote or read.
+template<class F>
+measurement measure(F&& f, std::chrono::milliseconds min_time = std::chrono::milliseconds(200))
+{
+    using clock = std::chrono::steady_clock;
+
+    // warm up
+    for (int i = 0; i < 1000; i++)
+        g_sink = g_sink + f();
+
+    size_t iters = 0, batch = 1000, bytes = 0;
+    auto const allocs = g_allocs.load(std::memory_order_relaxed);
+    auto start = clock::now();
+    auto elapsed = clock::duration{};
+
+    do
+    {
+        for (size_t i = 0; i < batch; i++)
+            bytes += f();
+
+        iters += batch;
+        elapsed = clock::now() - start;
+    } while (elapsed < min_time);
+
+    g_sink = g_sink + bytes;
+    return {
+        std::chrono::duration<double, std::nano>(elapsed).count() / iters,
+        double(bytes) / iters,
+        double(g_allocs.load(std::memory_order_relaxed) - allocs) / iters
+    };
+}
+
+// 'ops' is the num. of operations one call of 'f' does
+void report(const std::string& name, measurement m, size_t ops = 1)
+{
+    auto const ns = m.ns_per_op / ops;
+    std::printf("%-44s %9.1f ns/op", name.c_str(), ns);
+
+    if (m.bytes_per_op > 0)
+        std::printf(" %9.1f MB/s", m.bytes_per_op / m.ns_per_op * 1e3);
+    else
+        std::printf(" %9s     ", "-");
+
+#ifdef HAVE_MALLOC_COUNT
+    std::printf(" %7.2f allocs/op", m.allocs_per_op / ops);
+#endif
+    std::printf("\n");
+}
+
+template<class F>
+void run(const std::string& name, F&& f, size_t ops = 1)
+{
+    report(name, measure(f), ops);
+}
+
+#ifdef HAVE_DUP2
+// sends stdout to /dev/null while alive, for the printf cases
+class quiet_stdout
+{
+public:
+    quiet_stdout()
+    {
+        std::fflush(stdout);
+        m_saved = dup(fileno(stdout));
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, fileno(stdout));
+        close(null);
+    }
+
+    ~quiet_stdout()
+    {
+        std::fflush(stdout);
+        dup2(m_saved, fileno(stdout));
+        close(m_saved);
+    }
+
+private:
+    int m_saved;
+};
+#endif // HAVE_DUP2
+
+// the native locale, made current for the libc baselines
+class native_locale
+{
+public:
+    explicit native_locale(const char* name)
+    {
+#ifdef HAVE_USELOCALE
+        m_loc = newlocale(LC_ALL_MASK, name, (locale_t)0);
+        if (m_loc)
+            m_old = uselocale(m_loc);
+#endif
+    }
+
+    ~native_locale()
+    {
+#ifdef HAVE_USELOCALE
+        if (m_loc) {
+            uselocale(m_old);
+            freelocale(m_loc);
+        }
+#endif
+    }
+
+    explicit operator bool() const noexcept
+    {
+#ifdef HAVE_USELOCALE
+        return m_loc != (locale_t)0;
+#else
+        return false;
+#endif
+    }
+
+#ifdef HAVE_USELOCALE
+    locale_t get() const noexcept { return m_loc; }
+
+private:
+    locale_t m_loc = (locale_t)0, m_old = (locale_t)0;
+#endif
+};
+
+const double g_doubles[] = { 3.141592653589793, -0.000123456, 1234567.891, 6.02214076e23 };
+const int g_ints[] = { 0, 42, -1234567, 2147483647 };
+const char* const g_strs[] = { "a", "polylocale", "hello, world", "" };
+const wchar_t* const g_wstrs[] = { L"a", L"polylocale", L"olá mundo", L"" };
+
+// 'next' gives the argument of the i-th call
+template<class Next>
+void compare(poly_locale_t ploc, const char* localename, const char* fmt, Next&& next)
+{
+    char buf[256];
+    size_t i = 0;
+
+    run(std::string("poly_snprintf_l \"") + fmt + '"', [&] {
+        return (size_t)poly_snprintf_l(buf, sizeof buf, fmt, ploc, next(i++));
+    });
+
+    // glibc has no snprintf_l, the baseline is snprintf under uselocale (native_locale)
+    native_locale native{ localename };
+    if (native)
+    {
+        i = 0;
+        run(std::string("libc snprintf \"") + fmt + '"', [&] {
+            return (size_t)std::snprintf(buf, sizeof buf, fmt, next(i++));
+        });
+    }
+}
+
+void bench_conversions(poly_locale_t ploc, const char* localename)
+{
+    std::printf("\n-- conversions\n");
+
+    auto const ints = [](size_t i) { return g_ints[i % 4]; };
+    auto const uints = [](size_t i) { return (unsigned)g_ints[i % 4]; };
+    auto const doubles = [](size_t i) { return g_doubles[i % 4]; };
+
+    for (auto fmt : { "%d", "%+08d", "%-12d|", "%'d", "%.6d" })
+        compare(ploc, localename, fmt, ints);
+
+    for (auto fmt : { "%x", "%#x", "%08X", "%o", "%u" })
+        compare(ploc, localename, fmt, uints);
+
+    compare(ploc, localename, "%lld", [](size_t i) { return (long long)g_ints[i % 4] * 1000003; });
+
+    for (auto fmt : { "%f", "%.2f", "%+12.4f", "%'.2f", "%e", "%.3E", "%g", "%.17g", "%#g", "%a", "%.3A" })
+        compare(ploc, localename, fmt, doubles);
+
+    for (auto fmt : { "%s", "%-16s|", "%.3s" })
+        compare(ploc, localename, fmt, [](size_t i) { return g_strs[i % 4]; });
+
+    compare(ploc, localename, "%ls", [](size_t i) { return g_wstrs[i % 4]; });
+    compare(ploc, localename, "%p", [](size_t i) { return (const void*)&g_ints[i % 4]; });
+    compare(ploc, localename, "%c", [](size_t i) { return 'a' + (int)(i % 26); });
+
+    // the floor: to_chars knows nothing about locales or padding
+    char buf[64];
+    for (auto [name, format] : { std::pair{ "%f", std::chars_format::fixed }, std::pair{ "%e", std::chars_format::scientific },
+                                 std::pair{ "%g", std::chars_format::general }, std::pair{ "%a", std::chars_format::hex } })
+    {
+        size_t i = 0;
+        run(std::string("std::to_chars ") + name + " (precision 6)", [&] {
+            auto r = std::to_chars(buf, buf + sizeof buf, g_doubles[i++ % 4], format, 6);
+            return size_t(r.ptr - buf);
+        });
+    }
+}
+
+// the same format through every output path
+void bench_outputs(poly_locale_t ploc, const char* localename)
+{
+    std::printf("\n-- output paths\n");
+
+    const char fmt[] = "%s=%d (%.3f) %x\n";
+    char buf[256];
+    size_t i = 0;
+
+    run("poly_snprintf_l", [&] {
+        i++;
+        return (size_t)poly_snprintf_l(buf, sizeof buf, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+    });
+
+    run("poly_sprintf_l", [&] {
+        i++;
+        return (size_t)poly_sprintf_l(buf, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+    });
+
+    auto cf = poly_compile_format(fmt);
+    run("poly_snprintf_compiled_l", [&] {
+        i++;
+        return (size_t)poly_snprintf_compiled_l(buf, sizeof buf, cf, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+    });
+
+    // a translated message reordering the same arguments
+    run("poly_snprintf_l (positional \"%n$\")", [&] {
+        i++;
+        return (size_t)poly_snprintf_l(buf, sizeof buf, "%4$x %2$d (%3$.3f)=%1$s\n", ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+    });
+
+    run("format_to (compile-time format)", [&] {
+        i++;
+        auto end = red::polyloc::format_to(buf, ploc, POLYLOC_FMT("%s=%d (%.3f) %x\n"), g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        return size_t(end - buf);
+    });
+
+    // a heap string of unknown length, measuring first then formatting vs a single pass
+    run("poly_snprintf_l x2 + malloc (measure, format)", [&] {
+        i++;
+        auto n = poly_snprintf_l(nullptr, 0, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        auto str = static_cast<char*>(std::malloc(n + 1));
+        poly_snprintf_l(str, n + 1, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        std::free(str);
+        return (size_t)n;
+    });
+
+    run("poly_asprintf_l", [&] {
+        i++;
+        char* str;
+        auto n = poly_asprintf_l(&str, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        std::free(str);
+        return (size_t)n;
+    });
+
+    run("format (compile-time format, std::string)", [&] {
+        i++;
+        return red::polyloc::format(ploc, POLYLOC_FMT("%s=%d (%.3f) %x\n"), g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i).size();
+    });
+
+    // a log record built from fragments, the buffer reused from one record to the next
+    char storage[64];
+    auto record = poly_new_buffer(storage, sizeof storage);
+    run("poly_buffer_printf_l (4 fragments, reused)", [&] {
+        i++;
+        poly_buffer_clear(record);
+        poly_buffer_printf_l(record, "%s=", ploc, g_strs[i % 4]);
+        poly_buffer_printf_l(record, "%d ", ploc, g_ints[i % 4]);
+        poly_buffer_printf_l(record, "(%.3f) ", ploc, g_doubles[i % 4]);
+        poly_buffer_printf_l(record, "%x\n", ploc, (unsigned)i);
+        return poly_buffer_size(record);
+    });
+    poly_free_buffer(record);
+
+    wchar_t wbuf[256];
+    run("poly_swprintf_l", [&] {
+        i++;
+        return sizeof(wchar_t) * poly_swprintf_l(wbuf, 256, L"%ls=%d (%.3f) %x\n", ploc, g_wstrs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+    });
+
+    auto null = std::fopen(
+#ifdef _WIN32
+        "NUL",
+#else
+        "/dev/null",
+#endif
+        "w");
+
+    if (null)
+    {
+        run("poly_fprintf_l (null device)", [&] {
+            i++;
+            return (size_t)poly_fprintf_l(null, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        });
+
+        run("poly_fprintf_compiled_l (null device)", [&] {
+            i++;
+            return (size_t)poly_fprintf_compiled_l(null, cf, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        });
+
+#ifdef HAVE_DUP2
+        int fd = fileno(null);
+        run("poly_dprintf_l (null device)", [&] {
+            i++;
+            return (size_t)poly_dprintf_l(fd, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        });
+
+        poly_dprintf_batch(16 * 1024);
+        run("poly_dprintf_l (null device, 16K batches)", [&] {
+            i++;
+            return (size_t)poly_dprintf_l(fd, fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        });
+        poly_dprintf_batch(0);
+#endif
+    }
+
+#ifdef HAVE_DUP2
+    measurement m;
+    {
+        quiet_stdout quiet;
+        m = measure([&] {
+            i++;
+            return (size_t)poly_printf_l(fmt, ploc, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        });
+    }
+    report("poly_printf_l (stdout to null device)", m);
+#endif
+
+    native_locale native{ localename };
+    if (native)
+    {
+        run("libc snprintf", [&] {
+            i++;
+            return (size_t)std::snprintf(buf, sizeof buf, fmt, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+        });
+
+        if (null)
+        {
+            run("libc fprintf (null device)", [&] {
+                i++;
+                return (size_t)std::fprintf(null, fmt, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+            });
+
+#ifdef HAVE_DUP2
+            run("libc dprintf (null device)", [&] {
+                i++;
+                return (size_t)dprintf(fileno(null), fmt, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+            });
+#endif
+        }
+
+#ifdef HAVE_DUP2
+        {
+            quiet_stdout quiet;
+            m = measure([&] {
+                i++;
+                return (size_t)std::printf(fmt, g_strs[i % 4], g_ints[i % 4], g_doubles[i % 4], (unsigned)i);
+            });
+        }
+        report("libc printf (stdout to null device)", m);
+#endif
+    }
+
+    if (null)
+        std::fclose(null);
+    poly_free_format(cf);
+}
+
+void bench_strtod(poly_locale_t ploc, const char* localename)
+{
+    // written in the locale, so ',' locales get their decimal point
+    std::vector<std::string> inputs;
+    char buf[64];
+    for (double v : { 3.141592653589793, -0.000123456, 1234567.891, 6.02214076e23, 42.0 })
+    {
+        poly_snprintf_l(buf, sizeof buf, "%.17g", ploc, v);
+        inputs.push_back(buf);
+    }
+
+    std::printf("\n-- strtod\n");
+
+    size_t i = 0;
+    run("poly_strtod_l", [&] {
+        auto str = inputs[i++ % inputs.size()].c_str();
+        char* end;
+        g_sink = g_sink + (size_t)poly_strtod_l(str, &end, ploc);
+        return size_t(end - str);
+    });
+
+    // a 1000 field column, ns/op is per field
+    std::string csv;
+    for (size_t f = 0; f < 1000; f++)
+        csv += inputs[f % inputs.size()] + (f % 8 == 7 ? '\n' : ';');
+
+    std::vector<double> column(1000);
+    std::vector<unsigned char> errors(1000 / 8);
+
+    run("poly_parse_doubles_l (per field)", [&] {
+        poly_parse_doubles_l(csv.data(), csv.size(), ';', column.data(), column.size(), errors.data(), nullptr, ploc);
+        return csv.size();
+    }, column.size());
+
+    run("poly_strtod_l loop (per field)", [&] {
+        auto p = csv.c_str();
+        size_t n = 0;
+        for (char* end; n < column.size(); p = end + 1)
+            column[n++] = poly_strtod_l(p, &end, ploc);
+        return size_t(p - csv.c_str());
+    }, column.size());
+
+#ifdef HAVE_USELOCALE
+    native_locale native{ localename };
+    if (native)
+    {
+        i = 0;
+        run("libc strtod_l", [&] {
+            auto str = inputs[i++ % inputs.size()].c_str();
+            char* end;
+            g_sink = g_sink + (size_t)strtod_l(str, &end, native.get());
+            return size_t(end - str);
+        });
+    }
+#endif
+}
+
+void bench_locales(const char* localename)
+{
+    std::printf("\n-- locale objects\n");
+
+    // interned after the first call, this is the lookup + refcount
+    run("poly_newlocale + poly_freelocale", [&] {
+        poly_freelocale(poly_newlocale(POLY_ALL_MASK, localename, nullptr));
+        return size_t(0);
+    });
+
+    run("poly_newlocale(NUMERIC, base) + free", [&] {
+        auto base = poly_newlocale(POLY_ALL_MASK, "C", nullptr);
+        poly_freelocale(poly_newlocale(POLY_NUMERIC_MASK, localename, base));
+        return size_t(0);
+    });
+
+    auto ploc = poly_newlocale(POLY_ALL_MASK, localename, nullptr);
+    run("poly_duplocale + poly_freelocale", [&] {
+        poly_freelocale(poly_duplocale(ploc));
+        return size_t(0);
+    });
+
+    run("poly_uselocale x2", [&] {
+        auto old = poly_uselocale(ploc);
+        poly_uselocale(old);
+        return size_t(0);
+    });
+    poly_freelocale(ploc);
+
+#ifdef HAVE_USELOCALE
+    run("libc newlocale + freelocale", [&] {
+        if (auto l = newlocale(LC_ALL_MASK, localename, (locale_t)0))
+            freelocale(l);
+        return size_t(0);
+    });
+
+    if (auto cloc = newlocale(LC_ALL_MASK, localename, (locale_t)0))
+    {
+        run("libc duplocale + freelocale", [&] {
+            freelocale(duplocale(cloc));
+            return size_t(0);
+        });
+
+        run("libc uselocale x2", [&] {
+            auto old = uselocale(cloc);
+            uselocale(old);
+            return size_t(0);
+        });
+        freelocale(cloc);
+    }
+#endif
+}
+
+// the first of 'names' this system has
+std::string find_locale(std::initializer_list<const char*> names)
+{
+    for (auto name : names)
+    {
+        try {
+            std::locale l{ name };
+            return name;
+        }
+        catch (const std::runtime_error&) {
+            // not supported
+        }
+    }
+
+    return {};
+}
+
+} // unnamed
+
+
+int main(int argc, char* argv[])
+{
+    // locale names can be passed as arguments, the default is a '.' and a ',' decimal locale
+    std::vector<std::string> locales;
+    for (int i = 1; i < argc; i++)
+        locales.push_back(argv[i]);
+
+    if (locales.empty())
+    {
+        locales.push_back(find_locale({ "en_US.utf8", "en_US.UTF-8", "en_US", "C.utf8", "C" }));
+
+        auto comma = find_locale({ "pt_BR.utf8", "pt_BR.UTF-8", "pt_BR", "de_DE.utf8", "de_DE", "fr_FR.utf8", "fr_FR" });
+        if (comma.empty())
+            std::printf("no ',' decimal locale found, benchmarking '%s' only\n", locales[0].c_str());
+        else
+            locales.push_back(comma);
+    }
+
+    for (auto& name : locales)
+    {
+        auto ploc = poly_newlocale(POLY_ALL_MASK, name.c_str(), nullptr);
+        if (!ploc) {
+            std::printf("locale '%s' not available, skipped\n", name.c_str());
+            continue;
+        }
+
+        std::printf("\n==== locale '%s'\n", name.c_str());
+        bench_conversions(ploc, name.c_str());
+        bench_outputs(ploc, name.c_str());
+        bench_strtod(ploc, name.c_str());
+        bench_locales(name.c_str());
+
+        poly_freelocale(ploc);
+    }
+
+    return 0;
+}
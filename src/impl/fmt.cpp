@@ -1,206 +1,341 @@
 #include "printf_fmt.hpp"
+#include "stats.hpp"
+#include "bitmask.hpp"
 
 #include <algorithm>
 #include <iterator>
 #include <functional>
 #include <locale>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <cassert>
 
 
 namespace
 {
 
-constexpr char FMT_START   = '%';
-constexpr char FMT_FLAGS[] = "-+#0 ";
-constexpr char FMT_SIZES[] = "hljztI";
-constexpr char FMT_TYPES[] = "CcudioXxEeFfGgAapSsn";
-//constexpr char FMT_ALL[] = "%.*" "-+ #0" "hljztI" "CcudioXxEeFfGgAapSsn" /*"123456789"*/;
+using namespace red::polyloc::fmt_chars;
 
-// precision
-constexpr char FMT_PRECISION = '.';
-// value from VA
-constexpr char FMT_FROM_VA = '*';
+constexpr char SCAN_FLAGS[] = "*'";
+constexpr char SCAN_SIZES[] = "hljztIL";
+constexpr char SCAN_SET = '[';
 
-} // unnamed namespace
-
-using std::begin; using std::end;
-using std::find;
+// compiled format cache: per thread, set associative, a miss replaces the set's oldest entry.
+// Being per thread, a replaced entry can't be in use elsewhere; nested lookups of the
+// thread are handled by basic_fmt_lookup.
+constexpr size_t FMT_CACHE_SETS = 64; // power of 2
+constexpr size_t FMT_CACHE_WAYS = 4;
 
-bool red::polyloc::isfmtflag(char ch, bool zero, bool space)
+template<class CharT>
+struct fmt_cache_set
 {
-    auto end_ = end(FMT_FLAGS);
-    auto it = find(begin(FMT_FLAGS), end_, ch);
-
-    if (it != end_)
-    {
-        if (*it == '0')
-            return zero;
-        else if (*it == ' ')
-            return space;
-        else
-            return true;
-    }
-    else return false;
-}
+    std::unique_ptr<const red::polyloc::basic_compiled_fmt<CharT>> ways[FMT_CACHE_WAYS];
+    unsigned char next_victim = 0; // round robin
+};
 
-bool red::polyloc::isfmttype(char ch)
+template<class CharT>
+struct fmt_cache_t
 {
-    auto end_ = end(FMT_TYPES);
-    return find(begin(FMT_TYPES), end_, ch) != end_;
-}
+    fmt_cache_set<CharT> sets[FMT_CACHE_SETS];
+    unsigned lookups = 0; // alive basic_fmt_lookup objects
+};
 
-bool red::polyloc::isfmtsize(char ch)
+template<class CharT>
+fmt_cache_t<CharT>& thread_fmt_cache() noexcept
 {
-    auto end_ = end(FMT_SIZES);
-    return find(begin(FMT_SIZES), end_, ch) != end_;
+    // a function local, GCC 12 never destroyed a thread_local variable template
+    thread_local fmt_cache_t<CharT> cache;
+    return cache;
 }
 
-bool red::polyloc::isfmtchar(char ch, bool digits)
+size_t fmt_cache_set_of(const void* key) noexcept
 {
-    return ch == FMT_PRECISION || ch == FMT_FROM_VA ||
-        isfmtflag(ch, digits) || isfmtsize(ch) || isfmttype(ch)
-        || (digits && isdigit(ch, std::locale::classic()));
+    // Fibonacci hashing of the address, low bits are mostly alignment
+    auto h = (std::uintptr_t)key * 0x9E3779B97F4A7C15ull;
+    return size_t(h >> 40) & (FMT_CACHE_SETS - 1);
 }
 
+} // unnamed namespace
 
-namespace red::polyloc {
+using namespace bitmask::ops;
 
-const int fmtspec_t::VAL_VA = -(int)FMT_FROM_VA;
 
-bool fmt_separator::operator() (iterator& next, iterator end, std::string& token) {
-    using std::adjacent_find;
+template<class CharT>
+const CharT* red::polyloc::scan_scanf_token(const CharT* first, const CharT* last, basic_string_view<CharT>& token) noexcept
+{
+    if (first == last) {
+        token = {};
+        return last;
+    }
 
-    auto start = next;
-    if (start == end)
-        return false;
-    
-    if (*start == FMT_START)
+    if (*first != FMT_START)
     {
-        if (std::next(start) == end)
-            return false;
-
-        if (*std::next(start) == FMT_START) {
-            // escaped %
-            token.assign(1, FMT_START);
-            next += 2;
-            return true;
-        }
-        else {
-            // possible printf fmt
-            m_infmt = true;
-        }
+        auto next = std::char_traits<CharT>::find(first, size_t(last - first), CharT(FMT_START));
+        if (!next)
+            next = last;
+
+        token = { first, size_t(next - first) };
+        return next;
     }
 
-    if (m_infmt)
-    {
-        // "%# +o| %#o" "%10.5d|:%10.5d"
-        ptrdiff_t offs = 1;
-        next++;
-        auto fmtend = adjacent_find(next, end, [&](char l, char r) mutable {
-            if (isfmttype(l)) {
-                return true;
-            }
-            if (isfmtchar(l) && isfmttype(r)) {
-                offs = 2;
-                return true;
-            }
-            return false;
-        });
+    auto p = first + 1;
+    if (p == last) {
+        token = {};
+        return last;
+    }
+
+    if (*p == FMT_START) {
+        // "%%" is a conversion here, it skips space first
+        token = { first, 2 };
+        return p + 1;
+    }
+
+    // %[*]['][width][size]type, or %[...] for a set
+    while (p != last && (*p == '*' || *p == '\''))
+        p++;
 
-        offs = std::min(distance(fmtend, end), offs);
-        next = fmtend + offs;
+    p = skip(p, last, CL_DIGIT);
 
-        token.assign(start, next);
-        m_infmt = false;
+    while (p != last && (FMT_CLASS.is(*p, CL_SIZE) || *p == 'L'))
+    {
+        if (*p++ == 'I')
+            p = skip(p, last, CL_DIGIT);
     }
-    else
+
+    if (p != last && *p == SCAN_SET)
     {
-        next = find(start, end, FMT_START);
-        token.assign(start, next);
+        // ']' right after '[' or '[^' is part of the set
+        p++;
+        if (p != last && *p == '^')
+            p++;
+        if (p != last && *p == ']')
+            p++;
+
+        p = std::find(p, last, CharT(']'));
+        if (p != last)
+            p++;
+    }
+    else if (p != last && FMT_CLASS.is(*p, CL_TYPE))
+    {
+        p++;
     }
 
-    return true;
+    token = { first, size_t(p - first) };
+    return p;
 }
 
-void fmt_separator::reset()
-{
-    m_infmt = false;
-}
+template const char* red::polyloc::scan_scanf_token(const char*, const char*, string_view&) noexcept;
+template const wchar_t* red::polyloc::scan_scanf_token(const wchar_t*, const wchar_t*, wstring_view&) noexcept;
+
 
+namespace red::polyloc {
 
-fmtspec_t parsefmt(red::string_view spec, std::locale const& locale)
+fmtspec_t parsescanfmt(string_view spec)
 {
     constexpr auto npos = red::string_view::npos;
     fmtspec_t fmtspec{ spec };
     assert(spec.size() >= 2 && spec[0] == FMT_START);
 
-    size_t pos = 1;
-
-    // Flags
-    auto i = spec.find_first_not_of(FMT_FLAGS, 1);
-    if (i != npos)
+    if (spec[1] == FMT_START)
     {
-        fmtspec.flags = spec.substr(1, i-1);
-        pos = i;
+        fmtspec.conversion = FMT_START;
+        return fmtspec;
     }
 
-    // field width
-    if (spec[pos] == FMT_FROM_VA)
-    {
-        fmtspec.field_width = -(int)FMT_FROM_VA;
-        pos++;
-    }
-    else if (isdigit(spec[pos], locale)) try
+    // Flags
+    auto pos = std::min(spec.find_first_not_of(SCAN_FLAGS, 1), spec.size());
+    fmtspec.flags = spec.substr(1, pos - 1);
+    if (fmtspec.flags.find('*') != npos)
+        fmtspec.flagset |= fmt_flags::suppress;
+    if (fmtspec.flags.find('\'') != npos)
+        fmtspec.flagset |= fmt_flags::group;
+
+    // max field width
+    if (pos < spec.size() && FMT_CLASS.is(spec[pos], CL_DIGIT))
     {
-        size_t converted;
-        fmtspec.field_width = svtol(spec.substr(pos), &converted);
-        pos += converted;
-    }
-    catch (const std::exception&) {
-        // no conversion took place
+        int width = 0;
+        for (; pos < spec.size() && FMT_CLASS.is(spec[pos], CL_DIGIT); pos++)
+            width = width < 100000000 ? width * 10 + (spec[pos] - '0') : width;
+        fmtspec.field_width = width;
     }
 
-    // precision
-    if (spec[pos] == FMT_PRECISION)
-    {
-        pos++;
-        if (spec[pos] == FMT_FROM_VA)
+    // size overrides
+    auto i = std::min(spec.find_first_not_of(SCAN_SIZES, pos), spec.size());
+    if (i != pos && spec[pos] == 'I')
+        i = std::min(spec.find_first_not_of("6432", pos + 1), spec.size());
+
+    fmtspec.length_mod = spec.substr(pos, i - pos);
+    pos = i;
+
+    // conversion spec, the set of %[ stays in 'fmt'
+    if (pos < spec.size() && (spec[pos] == SCAN_SET || FMT_CLASS.is(spec[pos], CL_TYPE)))
+        fmtspec.conversion = spec[pos];
+
+    return fmtspec;
+}
+
+
+template<class CharT>
+basic_compiled_fmt<CharT>::basic_compiled_fmt(string_view_type format, fmt_kind kind)
+    : m_source(format), m_origin(format.data()), m_kind(kind)
+{
+    timed_call stat{ POLYLOC_STAT_PARSEFMT, true };
+
+    // calls 'f' w/ each token, split the printf or the scanf way
+    auto const for_each_token = [this](auto&& f) {
+        auto p = m_source.data();
+        auto const last = p + m_source.size();
+        string_view_type tok;
+
+        while (p != last)
         {
-            fmtspec.precision = -(int)FMT_FROM_VA;
-            pos++;
+            p = m_kind == fmt_kind::scan ? scan_scanf_token(p, last, tok) : scan_fmt_token(p, last, tok);
+            if (tok.empty())
+                break;
+            f(tok);
         }
-        else if (isdigit(spec[pos], locale)) try
+    };
+    auto const is_spec = [this](string_view_type tok) {
+        // a scanf "%%" is a conversion too
+        return tok.size() >= 2 && tok[0] == FMT_START;
+    };
+    auto const parse = [this](string_view spec) {
+        return m_kind == fmt_kind::scan ? parsescanfmt(spec) : parsefmt(spec);
+    };
+
+    if constexpr (!std::is_same_v<CharT, char>)
+    {
+        // specs are ASCII, keep narrow copies for parsefmt. Reserved up front so
+        // the views into it stay put.
+        size_t total = 0;
+        for_each_token([&](string_view_type tok) { total += is_spec(tok) ? tok.size() : 0; });
+        m_narrow_specs.reserve(total);
+    }
+
+    for_each_token([&](string_view_type tok) {
+        token t;
+        t.text = tok;
+
+        if (is_spec(tok))
         {
-            size_t converted;
-            fmtspec.precision = svtol(spec.substr(pos), &converted);
-            pos += converted;
+            if constexpr (std::is_same_v<CharT, char>)
+            {
+                t.spec = parse(tok);
+            }
+            else
+            {
+                auto const pos = m_narrow_specs.size();
+                for (auto ch : tok)
+                    m_narrow_specs += char(ch);
+                t.spec = parse(string_view(m_narrow_specs).substr(pos));
+            }
+            t.is_spec = true;
         }
-        catch (const std::exception&) {
-            // no conversion took place
+
+        m_tokens.push_back(t);
+    });
+
+    if (m_kind == fmt_kind::print)
+        scan_positions();
+
+    stat.done(m_source.size());
+}
+
+template<class CharT>
+void basic_compiled_fmt<CharT>::scan_positions()
+{
+    auto const numbered = std::any_of(m_tokens.begin(), m_tokens.end(), [](token const& t) {
+        return t.is_spec && t.spec.arg_pos > 0;
+    });
+    if (!numbered)
+        return;
+
+    // sets the type of argument 'pos', which must be the same for every use of it
+    auto const use = [this](int pos, arg_type type) {
+        if (pos < 1 || pos > FMT_ARG_MAX) {
+            m_args_ok = false;
+            return;
         }
+
+        if (size_t(pos) > m_arg_types.size())
+            m_arg_types.resize(pos, arg_type::none);
+
+        auto& slot = m_arg_types[pos - 1];
+        if (slot != arg_type::none && slot != type)
+            m_args_ok = false;
+        slot = type;
+    };
+
+    for (auto const& t : m_tokens)
+    {
+        if (!t.is_spec)
+            continue;
+
+        auto const type = arg_type_of(t.spec);
+        if (type == arg_type::none)
+            continue; // printed as-is, takes no argument
+
+        // every spec of a numbered format must be numbered, its '*' included
+        if (t.spec.field_width == fmtspec_t::VAL_VA)
+            use(t.spec.width_pos, arg_type::int32);
+        if (t.spec.precision == fmtspec_t::VAL_VA)
+            use(t.spec.precision_pos, arg_type::int32);
+        use(t.spec.arg_pos, type);
     }
-    
-    // size overrides
-    i = spec.find_first_of(FMT_SIZES, pos);
-    if (i != npos)
+
+    // a translation may drop an argument, like glibc the unused ones are taken as int
+    std::replace(m_arg_types.begin(), m_arg_types.end(), arg_type::none, arg_type::int32);
+}
+
+template class basic_compiled_fmt<char>;
+template class basic_compiled_fmt<wchar_t>;
+
+
+template<class CharT>
+static const basic_compiled_fmt<CharT>* find_compiled(basic_string_view<CharT> format, fmt_kind kind, fmt_cache_t<CharT>& cache)
+{
+    auto& set = cache.sets[fmt_cache_set_of(format.data())];
+
+    for (auto& way : set.ways)
     {
-        pos = i;
-        if (spec[pos] == 'I') {
-            i = spec.find_first_not_of("6432", pos);
+        // the same address may hold different text (reused buffers), so compare contents too
+        auto* cf = way.get();
+        if (cf && cf->origin() == format.data() && cf->kind() == kind && cf->source() == format) {
+            count(stat_counter::fmt_cache_hit);
+            return cf;
         }
-        else {
-            i = spec.find_first_not_of(FMT_SIZES, pos);
-        }
-        
-        fmtspec.length_mod = spec.substr(pos, i - pos);
-        pos = i;
     }
 
-    // conversion spec
-    i = spec.find_first_of(FMT_TYPES, pos);
-    if (i != npos)
-        fmtspec.conversion = spec.at(i);
+    count(stat_counter::fmt_cache_miss);
 
-    return fmtspec;
+    // an outer lookup of this thread may be using any entry
+    if (cache.lookups > 1)
+        return nullptr;
+
+    auto& victim = set.ways[set.next_victim];
+    set.next_victim = (set.next_victim + 1) % FMT_CACHE_WAYS;
+    victim = std::make_unique<basic_compiled_fmt<CharT>>(format, kind);
+    return victim.get();
+}
+
+template<class CharT>
+basic_fmt_lookup<CharT>::basic_fmt_lookup(basic_string_view<CharT> format, fmt_kind kind)
+{
+    auto& cache = thread_fmt_cache<CharT>();
+    cache.lookups++;
+    m_fmt = find_compiled(format, kind, cache);
 }
 
-} // red::polyloc
+template<class CharT>
+basic_fmt_lookup<CharT>::~basic_fmt_lookup()
+{
+    thread_fmt_cache<CharT>().lookups--;
+}
+
+template class basic_fmt_lookup<char>;
+template class basic_fmt_lookup<wchar_t>;
+
+} // red::polyloc
\ No newline at end of file
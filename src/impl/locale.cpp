@@ -0,0 +1,254 @@
+#include "locale.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cwchar>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+
+
+namespace
+{
+
+template<size_t N>
+void copy_str(char (&dest)[N], std::string const& src) noexcept
+{
+    auto n = std::min(src.size(), N - 1);
+    src.copy(dest, n);
+    dest[n] = '\0';
+}
+
+// encodes 2 and 3 byte code points, then compares against their UTF-8 form
+bool is_utf8(std::locale const& loc)
+{
+    using cvt = std::codecvt<wchar_t, char, std::mbstate_t>;
+    auto& cv = std::use_facet<cvt>(loc);
+
+    const wchar_t probe[] = { 0xE9, 0x20AC };
+    const char expected[] = "\xC3\xA9\xE2\x82\xAC";
+
+    char out[16];
+    std::mbstate_t state{};
+    const wchar_t* from_next;
+    char* to_next;
+
+    auto r = cv.out(state, probe, probe + 2, from_next, out, out + sizeof out, to_next);
+    return r == cvt::ok && red::string_view(out, to_next - out) == expected;
+}
+
+// Interned locales, never removed. The registry keeps one reference to each entry,
+// so they outlive every poly_freelocale.
+class locale_registry
+{
+public:
+    // a new reference to the entry for 'key', or null
+    poly_locale* find(std::string const& key) const
+    {
+        std::shared_lock lock{ m_mutex };
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return nullptr;
+
+        it->second->retain();
+        return it->second;
+    }
+
+    // adds 'ploc' as 'key', unless another thread got there first.
+    // Returns a new reference to the entry.
+    poly_locale* insert(std::string key, std::unique_ptr<poly_locale> ploc)
+    {
+        std::unique_lock lock{ m_mutex };
+        auto [it, inserted] = m_entries.try_emplace(std::move(key), ploc.get());
+        if (inserted)
+            ploc.release();
+
+        it->second->retain();
+        return it->second;
+    }
+
+    // makes 'key' another name for 'entry'
+    void alias(std::string key, poly_locale* entry)
+    {
+        std::unique_lock lock{ m_mutex };
+        m_entries.try_emplace(std::move(key), entry);
+    }
+
+private:
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<std::string, poly_locale*> m_entries;
+};
+
+// never destroyed, locales may still be in use by other static destructors
+locale_registry& registry()
+{
+    static auto instance = new locale_registry;
+    return *instance;
+}
+
+void release_locale(const poly_locale* ploc) noexcept
+{
+    if (ploc && ploc->release())
+        delete ploc;
+}
+
+// The snapshots of the std::locale's last formatted to by this thread, a lookup takes no lock.
+// Each entry holds a reference, released when it's replaced or the thread exits.
+constexpr size_t LOCALE_CACHE_SIZE = 4;
+
+struct locale_cache
+{
+    poly_locale* entries[LOCALE_CACHE_SIZE] = {};
+    size_t next_victim = 0; // round robin
+
+    ~locale_cache() {
+        for (auto ploc : entries)
+            release_locale(ploc);
+    }
+};
+
+thread_local locale_cache tl_locale_cache;
+
+} // unnamed
+
+
+red::polyloc::lc_data::lc_data(std::locale const& loc)
+{
+    auto& np = std::use_facet<std::numpunct<char>>(loc);
+    decimal_point = np.decimal_point();
+    thousands_sep = np.thousands_sep();
+    copy_str(grouping, np.grouping());
+
+    auto& wnp = std::use_facet<std::numpunct<wchar_t>>(loc);
+    wdecimal_point = wnp.decimal_point();
+    wthousands_sep = wnp.thousands_sep();
+    copy_str(wgrouping, wnp.grouping());
+
+    auto& ct = std::use_facet<std::ctype<char>>(loc);
+    for (int c = 0; c < 256; c++)
+    {
+        if (ct.is(std::ctype_base::space, (char)c))
+            space[c >> 3] |= 1 << (c & 7);
+    }
+
+    auto& wct = std::use_facet<std::ctype<wchar_t>>(loc);
+    for (size_t i = 0; i < std::size(WSPACE_CANDIDATES); i++)
+    {
+        if (wct.is(std::ctype_base::space, WSPACE_CANDIDATES[i]))
+            wspace |= std::uint32_t(1) << i;
+    }
+
+    try {
+        utf8 = is_utf8(loc);
+    }
+    catch (const std::exception&) {
+        utf8 = false;
+    }
+
+    auto& mp = std::use_facet<std::moneypunct<char>>(loc);
+    mon_decimal_point = mp.decimal_point();
+    mon_thousands_sep = mp.thousands_sep();
+    copy_str(mon_grouping, mp.grouping());
+    frac_digits = mp.frac_digits();
+    copy_str(currency_symbol, mp.curr_symbol());
+}
+
+
+poly_locale::poly_locale(std::locale const& l)
+    : poly_locale(l, l.name())
+{
+}
+
+poly_locale::poly_locale(std::locale const& l, std::string name_)
+    : loc(l), name(std::move(name_)), data(l),
+      wcvt(std::use_facet<std::codecvt<wchar_t, char, std::mbstate_t>>(loc))
+{
+}
+
+
+std::string red::polyloc::normalize_locale_name(string_view name)
+{
+    if (name == "POSIX")
+        return "C";
+
+    std::string result{ name };
+    auto const dot = result.find('.');
+
+    // leave composite names alone
+    if (dot == std::string::npos || result.find_first_of(";=") != std::string::npos)
+        return result;
+
+    auto end = result.find('@', dot);
+    if (end == std::string::npos)
+        end = result.size();
+
+    std::string codeset;
+    for (auto i = dot + 1; i < end; i++)
+    {
+        auto ch = result[i];
+        if (ch == '-' || ch == '_')
+            continue;
+        codeset += ch >= 'A' && ch <= 'Z' ? char(ch - 'A' + 'a') : ch;
+    }
+
+    result.replace(dot + 1, end - dot - 1, codeset);
+    return result;
+}
+
+poly_locale* red::polyloc::intern_locale(const char* name, int category_mask, std::locale::category cats)
+{
+    auto& reg = registry();
+    auto normalized = normalize_locale_name(name);
+    auto key = std::to_string(category_mask) + ':' + normalized;
+
+    if (auto ploc = reg.find(key)) {
+        count(stat_counter::registry_hit);
+        return ploc;
+    }
+
+    count(stat_counter::registry_miss);
+
+    // the categories not in the mask come from "C", like POSIX newlocale w/o a base
+    auto ploc = std::make_unique<poly_locale>(std::locale(std::locale::classic(), name, cats));
+
+    // "pt_BR" shares the entry of "pt_BR.utf8" if the system gave it UTF-8
+    bool const bare = normalized.find_first_of(".@;=") == std::string::npos && normalized.find('_') != std::string::npos;
+    if (bare && ploc->data.utf8)
+    {
+        auto entry = reg.insert(key + ".utf8", std::move(ploc));
+        reg.alias(std::move(key), entry);
+        return entry;
+    }
+
+    return reg.insert(std::move(key), std::move(ploc));
+}
+
+
+red::polyloc::cached_locale::cached_locale(std::locale const& loc)
+{
+    auto& cache = tl_locale_cache;
+
+    // unnamed locales are equal only to copies of themselves, named ones to the same name
+    for (auto ploc : cache.entries)
+    {
+        if (ploc && ploc->loc == loc) {
+            ploc->retain();
+            m_loc = ploc;
+            return;
+        }
+    }
+
+    auto fresh = new poly_locale(loc);
+    release_locale(std::exchange(cache.entries[cache.next_victim], fresh));
+    cache.next_victim = (cache.next_victim + 1) % LOCALE_CACHE_SIZE;
+
+    fresh->retain();
+    m_loc = fresh;
+}
+
+red::polyloc::cached_locale::~cached_locale()
+{
+    release_locale(m_loc);
+}
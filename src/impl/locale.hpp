@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <locale>
+#include <string>
+#include <type_traits>
+
+#include "polyimpl.h"
+
+namespace red::polyloc
+{
+    // Flat copy of the locale data used by the formatters and parsers.
+    // Taken once when a poly_locale is created, so hot paths never go through use_facet.
+    struct alignas(64) lc_data
+    {
+        // numpunct
+        char decimal_point = '.';
+        char thousands_sep = ',';
+        char grouping[14] = {}; // numpunct::grouping(), empty means no grouping
+
+        // numpunct<wchar_t>, may differ when the narrow ones need more than a char
+        wchar_t wdecimal_point = L'.';
+        wchar_t wthousands_sep = L',';
+        char wgrouping[14] = {};
+
+        // ctype
+        bool utf8 = false; // multibyte encoding is UTF-8
+        unsigned char space[32] = {}; // bitset, chars classified as space
+        std::uint32_t wspace = 0; // bitset, WSPACE_CANDIDATES classified as space
+
+        // moneypunct (local)
+        char mon_decimal_point = '.';
+        char mon_thousands_sep = ',';
+        char mon_grouping[14] = {};
+        int frac_digits = 0;
+        char currency_symbol[16] = {};
+
+        lc_data() = default;
+        explicit lc_data(std::locale const& loc);
+
+        bool isspace(char ch) const noexcept {
+            auto c = (unsigned char)ch;
+            return (space[c >> 3] & (1 << (c & 7))) != 0;
+        }
+
+        bool isspace(wchar_t ch) const noexcept {
+            if (std::make_unsigned_t<wchar_t>(ch) < 0x80)
+                return isspace(char(ch));
+
+            for (size_t i = 0; i < std::size(WSPACE_CANDIDATES); i++) {
+                if (ch == WSPACE_CANDIDATES[i])
+                    return (wspace >> i) & 1;
+            }
+            return false;
+        }
+
+        // punctuation for output or input of 'CharT'
+        template<class CharT>
+        CharT decimal_point_as() const noexcept {
+            if constexpr (std::is_same_v<CharT, char>) return decimal_point;
+            else return wdecimal_point;
+        }
+
+        template<class CharT>
+        CharT thousands_sep_as() const noexcept {
+            if constexpr (std::is_same_v<CharT, char>) return thousands_sep;
+            else return wthousands_sep;
+        }
+
+        template<class CharT>
+        const char* grouping_as() const noexcept {
+            if constexpr (std::is_same_v<CharT, char>) return grouping;
+            else return wgrouping;
+        }
+
+        // the non-ASCII code points a locale may call space
+        static constexpr wchar_t WSPACE_CANDIDATES[] = {
+            0x85, 0xA0, 0x1680, 0x2000, 0x2001, 0x2002, 0x2003, 0x2004, 0x2005, 0x2006,
+            0x2007, 0x2008, 0x2009, 0x200A, 0x2028, 0x2029, 0x202F, 0x205F, 0x3000
+        };
+    };
+}
+
+// Never modified once handed out, so any num. of threads can share one.
+// poly_duplocale is a retain(), poly_freelocale a release().
+struct poly_locale
+{
+    explicit poly_locale(std::locale const& l);
+    poly_locale(std::locale const& l, std::string name_);
+
+    poly_locale(poly_locale const&) = delete;
+    poly_locale& operator=(poly_locale const&) = delete;
+
+    void retain() const noexcept {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    // true if that was the last reference
+    bool release() const noexcept {
+        return refs.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    const std::locale loc;
+    const std::string name;
+    const red::polyloc::lc_data data;
+    // wchar_t to multibyte conversions of 'loc', for locales that aren't UTF-8
+    std::codecvt<wchar_t, char, std::mbstate_t> const& wcvt;
+
+private:
+    mutable std::atomic<long> refs{ 1 };
+};
+
+namespace red::polyloc
+{
+    // "pt_BR.UTF-8", "pt_BR.utf-8" -> "pt_BR.utf8", "POSIX" -> "C"
+    std::string normalize_locale_name(string_view name);
+
+    // Process-wide registry of locales by name and category mask, so each one is only
+    // loaded once. Returns a new reference to the shared object, or throws like std::locale.
+    poly_locale* intern_locale(const char* name, int category_mask, std::locale::category cats);
+
+    // The locale behind a poly_locale_t, POLY_GLOBAL_LOCALE included. Throws std::invalid_argument on null.
+    const poly_locale& resolve_locale(poly_locale* loc);
+
+    // The poly_locale of a std::locale, from a small per thread cache keyed by locale identity,
+    // so the std::ostream overloads don't retake the snapshot on every call. Holds a reference
+    // while alive, so a nested call replacing the entry can't free it.
+    class cached_locale
+    {
+    public:
+        explicit cached_locale(std::locale const& loc);
+        ~cached_locale();
+        cached_locale(cached_locale const&) = delete;
+        cached_locale& operator=(cached_locale const&) = delete;
+
+        const poly_locale& get() const noexcept { return *m_loc; }
+
+    private:
+        poly_locale* m_loc;
+    };
+}
@@ -0,0 +1,448 @@
+#include "numfmt.hpp"
+#include "sink.hpp"
+#include "locale.hpp"
+#include "bitmask.hpp"
+
+#include <charconv>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <climits>
+#include <cmath>
+#include <cstring>
+
+
+using red::polyloc::fmt_flags;
+using red::polyloc::lc_data;
+namespace bm = bitmask;
+using namespace bitmask::ops;
+
+namespace
+{
+
+// "00010203...99"
+struct digit_pairs
+{
+    char d[200] = {};
+
+    constexpr digit_pairs()
+    {
+        for (int i = 0; i < 100; i++)
+        {
+            d[i * 2] = char('0' + i / 10);
+            d[i * 2 + 1] = char('0' + i % 10);
+        }
+    }
+};
+
+constexpr digit_pairs DIGIT_PAIRS;
+constexpr char HEX_LOWER[] = "0123456789abcdef";
+constexpr char HEX_UPPER[] = "0123456789ABCDEF";
+
+// these write the digits of 'v' backwards, ending at 'last'. Return the first digit.
+
+char* to_dec(char* last, std::uint64_t v) noexcept
+{
+    while (v >= 100)
+    {
+        auto i = size_t(v % 100) * 2;
+        v /= 100;
+        last -= 2;
+        std::memcpy(last, DIGIT_PAIRS.d + i, 2);
+    }
+
+    if (v >= 10)
+    {
+        last -= 2;
+        std::memcpy(last, DIGIT_PAIRS.d + v * 2, 2);
+    }
+    else
+    {
+        *--last = char('0' + v);
+    }
+
+    return last;
+}
+
+char* to_hex(char* last, std::uint64_t v, const char* digits) noexcept
+{
+    do {
+        *--last = digits[v & 0xf];
+        v >>= 4;
+    } while (v);
+
+    return last;
+}
+
+char* to_oct(char* last, std::uint64_t v) noexcept
+{
+    do {
+        *--last = char('0' + (v & 7));
+        v >>= 3;
+    } while (v);
+
+    return last;
+}
+
+// room kept after the to_chars output, for a forced point and grouping separators
+constexpr size_t FP_SLACK = 320;
+
+// room for to_chars w/ 'precision' digits after the point and the integer part of DBL_MAX,
+// plus FP_SLACK
+constexpr size_t fp_capacity(int precision) noexcept
+{
+    return 330 + size_t(precision > 6 ? precision : 6) + FP_SLACK;
+}
+
+void to_upper(char* first, char* last) noexcept
+{
+    for (; first != last; ++first)
+    {
+        if (*first >= 'a' && *first <= 'z')
+            *first -= 'a' - 'A';
+    }
+}
+
+// inserts a '.' before the exponent, or at the end if there's none. Returns the new end.
+char* force_point(char* first, char* last, char expch) noexcept
+{
+    if (std::find(first, last, '.') != last)
+        return last;
+
+    auto e = std::find(first, last, expch);
+    std::move_backward(e, last, last + 1);
+    *e = '.';
+    return last + 1;
+}
+
+// %#g, which unlike to_chars(general) keeps trailing zeros
+std::to_chars_result to_chars_general_alt(char* first, char* last, double value, int precision)
+{
+    auto r = std::to_chars(first, last, value, std::chars_format::scientific, precision - 1);
+    if (r.ec != std::errc{})
+        return r;
+
+    // exponent X of the rounded value, C11 7.21.6.1
+    auto e = std::find(first, r.ptr, 'e');
+    int x = 0;
+    for (auto p = e + 2; p < r.ptr; p++)
+        x = x * 10 + (*p - '0');
+    if (e[1] == '-')
+        x = -x;
+
+    if (precision > x && x >= -4)
+        return std::to_chars(first, last, value, std::chars_format::fixed, precision - 1 - x);
+
+    return r;
+}
+
+// 'str' as CharT, widened into 'dest' unless CharT is char
+template<class CharT>
+red::basic_string_view<CharT> as_chars(const char* str, size_t n, CharT* dest) noexcept
+{
+    if constexpr (std::is_same_v<CharT, char>)
+    {
+        return { str, n };
+    }
+    else
+    {
+        std::copy(str, str + n, dest);
+        return { dest, n };
+    }
+}
+
+} // unnamed
+
+
+template<class CharT>
+void red::polyloc::put_padded(basic_sink<CharT>& out, string_view prefix, basic_string_view<typename basic_sink<CharT>::char_type> body,
+                              int width, fmt_flags flags, size_t zeros)
+{
+    auto const len = prefix.size() + zeros + body.size();
+    auto const pad = width > 0 && size_t(width) > len ? size_t(width) - len : 0;
+
+    if (pad == 0)
+    {
+        out.widen(prefix);
+        out.fill('0', zeros);
+        out.write(body);
+    }
+    else if (bm::has(flags, fmt_flags::left))
+    {
+        // '-' overrides '0', zeros on the right would change the number
+        out.widen(prefix);
+        out.fill('0', zeros);
+        out.write(body);
+        out.fill(' ', pad);
+    }
+    else if (bm::has(flags, fmt_flags::zero))
+    {
+        out.widen(prefix);
+        out.fill('0', pad + zeros);
+        out.write(body);
+    }
+    else
+    {
+        out.fill(' ', pad);
+        out.widen(prefix);
+        out.fill('0', zeros);
+        out.write(body);
+    }
+}
+
+template<class CharT>
+size_t red::polyloc::group_digits(const CharT* digits, size_t n, lc_data const& lc, CharT* dest) noexcept
+{
+    const char* grouping = lc.grouping_as<CharT>();
+    CharT const sep = lc.thousands_sep_as<CharT>();
+
+    if (!*grouping || !sep)
+    {
+        std::copy(digits, digits + n, dest);
+        return n;
+    }
+
+    // fill 'dest' backwards from its end, then move it to the front
+    auto const dest_end = dest + 2 * n;
+    auto w = dest_end;
+    auto r = digits + n;
+    int group = (signed char)*grouping;
+    int in_group = 0;
+
+    while (r != digits)
+    {
+        if (group > 0 && group != CHAR_MAX && in_group == group)
+        {
+            *--w = sep;
+            in_group = 0;
+
+            // the last group size repeats
+            if (grouping[1])
+                group = (signed char)*++grouping;
+        }
+
+        *--w = *--r;
+        in_group++;
+    }
+
+    auto len = size_t(dest_end - w);
+    std::copy(w, dest_end, dest);
+    return len;
+}
+
+template<class CharT>
+void red::polyloc::put_int(basic_sink<CharT>& out, std::uint64_t value, bool negative, char conversion, int width, int precision, fmt_flags flags, lc_data const& lc)
+{
+    char prefix[3];
+    size_t plen = 0;
+
+    if (conversion == 'd' || conversion == 'i')
+    {
+        if (negative)
+            prefix[plen++] = '-';
+        else if (bm::has(flags, fmt_flags::plus))
+            prefix[plen++] = '+';
+        else if (bm::has(flags, fmt_flags::space))
+            prefix[plen++] = ' ';
+    }
+
+    char buf[24];
+    auto const last = buf + sizeof buf;
+    auto first = last;
+
+    // a precision of 0 and a value of 0 produce no digits
+    if (value != 0 || precision != 0)
+    {
+        switch (conversion)
+        {
+        case 'o':
+            first = to_oct(last, value);
+            break;
+        case 'x':
+        case 'p':
+            first = to_hex(last, value, HEX_LOWER);
+            break;
+        case 'X':
+            first = to_hex(last, value, HEX_UPPER);
+            break;
+        default:
+            first = to_dec(last, value);
+            break;
+        }
+    }
+
+    auto ndigits = size_t(last - first);
+    size_t zeros = precision > 0 && size_t(precision) > ndigits ? size_t(precision) - ndigits : 0;
+
+    if (conversion == 'p' && value != 0)
+    {
+        prefix[plen++] = '0';
+        prefix[plen++] = 'x';
+    }
+    else if (bm::has(flags, fmt_flags::alt))
+    {
+        // octal: the first digit must be a 0, hex: nonzero values get 0x
+        if (conversion == 'o' && zeros == 0 && (ndigits == 0 || *first != '0'))
+            zeros = 1;
+        else if ((conversion == 'x' || conversion == 'X') && value != 0)
+        {
+            prefix[plen++] = '0';
+            prefix[plen++] = conversion;
+        }
+    }
+
+    // '0' is ignored if a precision or '-' is given, C11 7.21.6.1
+    if (precision >= 0 || bm::has(flags, fmt_flags::left))
+        flags &= ~fmt_flags::zero;
+
+    // POSIX only groups decimal conversions
+    bool const decimal = conversion == 'd' || conversion == 'i' || conversion == 'u';
+
+    CharT wide[sizeof buf];
+    auto const digits = as_chars(first, ndigits, wide);
+
+    if (bm::has(flags, fmt_flags::group) && decimal && ndigits > 3)
+    {
+        CharT grouped[2 * sizeof buf];
+        auto glen = group_digits(digits.data(), ndigits, lc, grouped);
+        put_padded(out, { prefix, plen }, { grouped, glen }, width, flags, zeros);
+    }
+    else
+    {
+        put_padded(out, { prefix, plen }, digits, width, flags, zeros);
+    }
+}
+
+template<class CharT>
+void red::polyloc::put_fp(basic_sink<CharT>& out, double value, char conversion, int width, int precision, fmt_flags flags, lc_data const& lc)
+{
+    bool const upper = conversion >= 'A' && conversion <= 'Z';
+    char const conv = char(conversion | ('a' - 'A'));
+    char const expch = conv == 'a' ? 'p' : 'e';
+
+    char prefix[4];
+    size_t plen = 0;
+
+    // '0' is ignored if '-' is given
+    if (bm::has(flags, fmt_flags::left))
+        flags &= ~fmt_flags::zero;
+
+    if (std::signbit(value))
+        prefix[plen++] = '-';
+    else if (bm::has(flags, fmt_flags::plus))
+        prefix[plen++] = '+';
+    else if (bm::has(flags, fmt_flags::space))
+        prefix[plen++] = ' ';
+
+    if (!std::isfinite(value))
+    {
+        CharT wide[3];
+        auto body = as_chars(std::isnan(value) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf"), 3, wide);
+        put_padded(out, { prefix, plen }, body, width, flags & ~fmt_flags::zero);
+        return;
+    }
+
+    value = std::fabs(value);
+
+    if (conv == 'a')
+    {
+        prefix[plen++] = '0';
+        prefix[plen++] = upper ? 'X' : 'x';
+    }
+
+    char stackbuf[1024];
+    std::unique_ptr<char[]> heapbuf;
+    auto const cap = fp_capacity(precision);
+    char* buf = stackbuf;
+
+    if (cap > sizeof stackbuf)
+    {
+        heapbuf.reset(new char[cap]);
+        buf = heapbuf.get();
+    }
+
+    auto const last = buf + cap - FP_SLACK;
+    std::to_chars_result r;
+
+    switch (conv)
+    {
+    case 'f':
+        r = std::to_chars(buf, last, value, std::chars_format::fixed, precision < 0 ? 6 : precision);
+        break;
+    case 'e':
+        r = std::to_chars(buf, last, value, std::chars_format::scientific, precision < 0 ? 6 : precision);
+        break;
+    case 'a':
+        r = precision < 0 ? std::to_chars(buf, last, value, std::chars_format::hex)
+                          : std::to_chars(buf, last, value, std::chars_format::hex, precision);
+        break;
+    default: // g
+        precision = precision < 0 ? 6 : std::max(precision, 1);
+        r = bm::has(flags, fmt_flags::alt) ? to_chars_general_alt(buf, last, value, precision)
+                                          : std::to_chars(buf, last, value, std::chars_format::general, precision);
+        break;
+    }
+
+    if (r.ec != std::errc{})
+        return; // can't happen w/ fp_capacity, but don't print garbage
+
+    auto end = r.ptr;
+
+    if (bm::has(flags, fmt_flags::alt))
+        end = force_point(buf, end, expch);
+
+    bool const has_exp = std::find(buf, end, expch) != end;
+
+    if (upper)
+        to_upper(buf, end);
+
+    // the rest works on CharT, wide output gets a widened copy (w/ the same slack)
+    CharT* first;
+    CharT* last_ch;
+    CharT widestack[std::is_same_v<CharT, char> ? 1 : sizeof stackbuf];
+    std::unique_ptr<CharT[]> widebuf;
+
+    if constexpr (std::is_same_v<CharT, char>)
+    {
+        first = buf;
+        last_ch = end;
+    }
+    else
+    {
+        first = widestack;
+        if (cap > std::size(widestack))
+        {
+            widebuf.reset(new CharT[cap]);
+            first = widebuf.get();
+        }
+        last_ch = std::copy(buf, end, first);
+    }
+
+    auto point = std::find(first, last_ch, CharT('.'));
+    if (point != last_ch)
+        *point = lc.decimal_point_as<CharT>();
+
+    if (bm::has(flags, fmt_flags::group) && !has_exp)
+    {
+        CharT grouped[640];
+        auto intlen = size_t(point - first);
+        auto glen = group_digits(first, intlen, lc, grouped);
+
+        std::move_backward(point, last_ch, last_ch + (glen - intlen));
+        std::copy(grouped, grouped + glen, first);
+        last_ch += glen - intlen;
+    }
+
+    put_padded(out, { prefix, plen }, { first, size_t(last_ch - first) }, width, flags);
+}
+
+
+template void red::polyloc::put_padded(sink&, string_view, string_view, int, fmt_flags, size_t);
+template void red::polyloc::put_padded(wsink&, string_view, wstring_view, int, fmt_flags, size_t);
+template size_t red::polyloc::group_digits(const char*, size_t, lc_data const&, char*) noexcept;
+template size_t red::polyloc::group_digits(const wchar_t*, size_t, lc_data const&, wchar_t*) noexcept;
+template void red::polyloc::put_int(sink&, std::uint64_t, bool, char, int, int, fmt_flags, lc_data const&);
+template void red::polyloc::put_int(wsink&, std::uint64_t, bool, char, int, int, fmt_flags, lc_data const&);
+template void red::polyloc::put_fp(sink&, double, char, int, int, fmt_flags, lc_data const&);
+template void red::polyloc::put_fp(wsink&, double, char, int, int, fmt_flags, lc_data const&);
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "polyimpl.h"
+#include "printf_fmt.hpp"
+
+#include <cstdint>
+
+namespace red::polyloc
+{
+    template<class CharT> class basic_sink;
+    struct lc_data;
+
+    // Writes 'prefix' (sign, 0x), 'zeros' '0's and 'body', padded to 'width'.
+    // Zero padding goes between prefix and body.
+    template<class CharT>
+    void put_padded(basic_sink<CharT>& out, string_view prefix, basic_string_view<typename basic_sink<CharT>::char_type> body,
+                    int width, fmt_flags flags, size_t zeros = 0);
+
+    // Copies the 'n' integer digits at 'digits' into 'dest', inserting the locale's thousands
+    // separator according to its grouping. 'dest' needs room for 2*n chars.
+    // Returns the num. of chars written.
+    template<class CharT>
+    size_t group_digits(const CharT* digits, size_t n, lc_data const& lc, CharT* dest) noexcept;
+
+    // %d %i %u %o %x %X %p
+    // 'value' is the magnitude, 'negative' its sign (only used by %d %i).
+    template<class CharT>
+    void put_int(basic_sink<CharT>& out, std::uint64_t value, bool negative, char conversion, int width, int precision, fmt_flags flags, lc_data const& lc);
+
+    // %e %E %f %F %g %G %a %A
+    // Formats with std::to_chars, then applies the locale's decimal point and grouping.
+    template<class CharT>
+    void put_fp(basic_sink<CharT>& out, double value, char conversion, int width, int precision, fmt_flags flags, lc_data const& lc);
+}
@@ -0,0 +1,463 @@
+#include "numparse.hpp"
+#include "locale.hpp"
+
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+
+namespace
+{
+
+template<class CharT>
+bool isdigit10(CharT ch) noexcept
+{
+    return unsigned(ch - '0') < 10;
+}
+
+template<class CharT>
+bool isdigit16(CharT ch) noexcept
+{
+    return isdigit10(ch) || unsigned((ch | 0x20) - 'a') < 6;
+}
+
+// value of 'ch' as a base 36 digit, 36 or more if it isn't one
+template<class CharT>
+unsigned digit_value(CharT ch) noexcept
+{
+    if (isdigit10(ch))
+        return unsigned(ch - '0');
+
+    auto letter = unsigned((ch | 0x20) - 'a');
+    return letter < 26 ? letter + 10 : 36;
+}
+
+// case insensitive prefix match, 'word' is lowercase
+template<class CharT>
+bool match(const CharT* p, const char* word) noexcept
+{
+    for (; *word; ++p, ++word)
+    {
+        if ((*p | 0x20) != *word)
+            return false;
+    }
+    return true;
+}
+
+// digits of a decimal or hex float, w/o sign and 0x
+template<class CharT>
+struct fp_span
+{
+    const CharT* first;
+    const CharT* last;
+    const CharT* point; // decimal point in [first, last), or null
+    bool has_seps;     // thousands separators in the integer part
+    int magnitude;     // rough exponent of the value, tells overflow from underflow
+};
+
+// [digits][point digits][(e|p)[sign]digits], returns false if there are no digits
+// A 'sep' between integer digits is skipped, unless it's '\0'.
+template<bool Hex, class CharT>
+bool scan_fp(const CharT* p, CharT decimal_point, CharT sep, fp_span<CharT>& s) noexcept
+{
+    auto const isdigit = [](CharT ch) { return Hex ? isdigit16(ch) : isdigit10(ch); };
+    bool any = false, nonzero = false;
+    int intdigits = 0, fraczeros = 0;
+
+    s.first = p;
+    s.point = nullptr;
+    s.has_seps = false;
+
+    for (; isdigit(*p); p++)
+    {
+        nonzero = nonzero || *p != '0';
+        intdigits += nonzero;
+        any = true;
+
+        if (sep && p[1] == sep && isdigit(p[2]))
+        {
+            s.has_seps = true;
+            p++;
+        }
+    }
+
+    if (*p == decimal_point && (any || isdigit(p[1])))
+    {
+        s.point = p++;
+        for (; isdigit(*p); p++)
+        {
+            if (!nonzero)
+            {
+                nonzero = *p != '0';
+                fraczeros += !nonzero;
+            }
+            any = true;
+        }
+    }
+
+    if (!any)
+        return false;
+
+    // exponent, only taken if it has digits
+    long exp = 0;
+    if ((*p | 0x20) == (Hex ? 'p' : 'e'))
+    {
+        auto q = p + 1;
+        bool neg = *q == '-';
+        if (*q == '+' || *q == '-')
+            q++;
+
+        if (isdigit10(*q))
+        {
+            for (; isdigit10(*q); q++)
+            {
+                if (exp < 100000)
+                    exp = exp * 10 + (*q - '0');
+            }
+            exp = neg ? -exp : exp;
+            p = q;
+        }
+    }
+
+    s.last = p;
+    s.magnitude = int((intdigits > 0 ? intdigits : -fraczeros) * (Hex ? 4 : 1) + exp);
+    return true;
+}
+
+// finds the first 'a' or 'b' in [first, last), 8 bytes at a time
+const char* find_either(const char* first, const char* last, char a, char b) noexcept
+{
+    constexpr std::uint64_t ones = 0x0101010101010101, highs = 0x8080808080808080;
+    std::uint64_t const ma = ones * (unsigned char)a, mb = ones * (unsigned char)b;
+
+    for (; last - first >= 8; first += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, first, 8);
+
+        // a byte of xa or xb is zero where there's a match
+        auto xa = word ^ ma, xb = word ^ mb;
+        if ((((xa - ones) & ~xa) | ((xb - ones) & ~xb)) & highs)
+            break;
+    }
+
+    for (; first != last; ++first)
+    {
+        if (*first == a || *first == b)
+            return first;
+    }
+
+    return last;
+}
+
+} // unnamed
+
+
+template<class T, class CharT>
+T red::polyloc::strto_fp(const CharT* str, CharT** endptr, lc_data const& lc, bool grouped)
+{
+    auto p = str;
+    auto setend = [endptr](const CharT* end) {
+        if (endptr)
+            *endptr = const_cast<CharT*>(end);
+    };
+
+    while (lc.isspace(*p))
+        p++;
+
+    bool const neg = *p == '-';
+    if (*p == '+' || *p == '-')
+        p++;
+
+    T value;
+
+    if (match(p, "inf"))
+    {
+        p += match(p + 3, "inity") ? 8 : 3;
+        value = std::numeric_limits<T>::infinity();
+        setend(p);
+        return neg ? -value : value;
+    }
+
+    if (match(p, "nan"))
+    {
+        p += 3;
+        if (*p == '(')
+        {
+            // nan(n-char-sequence)
+            auto q = p + 1;
+            while (isdigit10(*q) || unsigned((*q | 0x20) - 'a') < 26 || *q == '_')
+                q++;
+            if (*q == ')')
+                p = q + 1;
+        }
+        value = std::numeric_limits<T>::quiet_NaN();
+        setend(p);
+        return neg ? -value : value;
+    }
+
+    CharT const dp = lc.decimal_point_as<CharT>();
+    CharT const ts = lc.thousands_sep_as<CharT>();
+    CharT const sep = grouped && *lc.grouping_as<CharT>() && ts != dp ? ts : CharT();
+
+    fp_span<CharT> s;
+    bool const hex = p[0] == '0' && (p[1] | 0x20) == 'x' && scan_fp<true>(p + 2, dp, CharT(), s);
+
+    if (!hex && !scan_fp<false>(p, dp, sep, s))
+    {
+        // no conversion
+        setend(str);
+        return 0;
+    }
+
+    const char* first;
+    const char* last;
+
+    // from_chars only knows char and '.', hand it a narrow copy w/ the locale's decimal
+    // point replaced and the separators removed. The span is ASCII besides those two.
+    char stackbuf[128];
+    std::unique_ptr<char[]> heapbuf;
+
+    if constexpr (std::is_same_v<CharT, char>)
+    {
+        first = s.first;
+        last = s.last;
+    }
+
+    if (!std::is_same_v<CharT, char> || (s.point && dp != '.') || s.has_seps)
+    {
+        auto n = size_t(s.last - s.first);
+        char* buf = stackbuf;
+        if (n > sizeof stackbuf)
+        {
+            heapbuf.reset(new char[n]);
+            buf = heapbuf.get();
+        }
+
+        auto intend = s.point ? s.point : s.last;
+        auto w = buf;
+        for (auto r = s.first; r != s.last; ++r)
+        {
+            if (r == s.point)
+                *w++ = '.';
+            else if (r >= intend || *r != sep)
+                *w++ = char(*r);
+        }
+
+        first = buf;
+        last = w;
+    }
+
+    auto r = std::from_chars(first, last, value, hex ? std::chars_format::hex : std::chars_format::general);
+    if (r.ec == std::errc::result_out_of_range)
+    {
+        errno = ERANGE;
+        value = s.magnitude > 0 ? std::numeric_limits<T>::infinity() : T(0);
+    }
+    else if (!hex && value != 0 && value < std::numeric_limits<T>::min())
+    {
+        // glibc also reports (inexact) subnormal results
+        errno = ERANGE;
+    }
+
+    setend(s.last);
+    return neg ? -value : value;
+}
+
+template<class T, class CharT>
+T red::polyloc::strto_int(const CharT* str, CharT** endptr, int base, lc_data const& lc, bool grouped)
+{
+    using acc_t = unsigned long long;
+
+    auto p = str;
+    auto setend = [endptr](const CharT* end) {
+        if (endptr)
+            *endptr = const_cast<CharT*>(end);
+    };
+
+    if (base < 0 || base == 1 || base > 36)
+    {
+        errno = EINVAL;
+        setend(str);
+        return 0;
+    }
+
+    while (lc.isspace(*p))
+        p++;
+
+    bool const neg = *p == '-';
+    if (*p == '+' || *p == '-')
+        p++;
+
+    // the 0x is only taken if a hex digit follows
+    if ((base == 0 || base == 16) && p[0] == '0' && (p[1] | 0x20) == 'x' && isdigit16(p[2]))
+    {
+        p += 2;
+        base = 16;
+    }
+    else if (base == 0)
+    {
+        base = *p == '0' ? 8 : 10;
+    }
+
+    CharT const sep = grouped && base == 10 && *lc.grouping_as<CharT>() ? lc.thousands_sep_as<CharT>() : CharT();
+    acc_t const cutoff = ULLONG_MAX / unsigned(base);
+    unsigned const cutlim = ULLONG_MAX % unsigned(base);
+    acc_t value = 0;
+    bool overflow = false;
+    auto const first = p;
+
+    for (;; p++)
+    {
+        auto d = digit_value(*p);
+        if (d >= unsigned(base))
+        {
+            if (sep && *p == sep && p != first && isdigit10(p[1]))
+                continue;
+            break;
+        }
+
+        if (value > cutoff || (value == cutoff && d > cutlim))
+            overflow = true;
+        else
+            value = value * unsigned(base) + d;
+    }
+
+    if (p == first)
+    {
+        // no conversion
+        setend(str);
+        return 0;
+    }
+
+    setend(p);
+
+    // unsigned types take '-' as negation, like strtoul
+    acc_t const max = std::numeric_limits<T>::max();
+    acc_t const limit = std::is_signed_v<T> && neg ? max + 1 : max;
+
+    if (overflow || value > limit)
+    {
+        errno = ERANGE;
+        return std::is_signed_v<T> && neg ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+    }
+
+    return neg ? T(0 - value) : T(value);
+}
+
+size_t red::polyloc::parse_fp_fields(const char* first, const char* last, char delim, double* out, size_t n,
+                                     unsigned char* errors, const char** endptr, lc_data const& lc)
+{
+    auto const saved_errno = errno;
+    auto const is_stop = [delim](char ch) { return ch == delim || ch == '\n'; };
+
+    // Fields before the last delimiter are parsed in place, strto_fp stops at the delimiter
+    // that follows them. Unless the delimiter could be part of a number.
+    auto safe_end = last;
+    while (safe_end != first && !is_stop(safe_end[-1]))
+        safe_end--;
+
+    if (digit_value(delim) < 36 || delim == lc.decimal_point || std::strchr("+-._()", delim))
+        safe_end = first;
+
+    char stackbuf[128];
+    std::string heapbuf;
+    size_t count = 0;
+
+    while (count < n && first != last)
+    {
+        // not strto_fp's job, it would skip newlines and blank delimiters
+        auto p = first;
+        while (p != last && !is_stop(*p) && lc.isspace(*p))
+            p++;
+
+        const char* field_end;
+        double value = 0;
+        bool parsed = false, whole;
+        errno = 0;
+
+        if (p < safe_end)
+        {
+            char* end = const_cast<char*>(p);
+            if (!is_stop(*p))
+                value = strto_fp<double>(p, &end, lc);
+
+            parsed = end != p;
+            while (!is_stop(*end) && lc.isspace(*end))
+                end++;
+
+            whole = is_stop(*end);
+            field_end = whole ? end : find_either(end, last, delim, '\n');
+        }
+        else
+        {
+            // the last field isn't terminated, parse a copy
+            field_end = find_either(p, last, delim, '\n');
+            auto const len = size_t(field_end - p);
+
+            const char* str = stackbuf;
+            if (len < sizeof stackbuf)
+            {
+                std::memcpy(stackbuf, p, len);
+                stackbuf[len] = '\0';
+            }
+            else
+            {
+                heapbuf.assign(p, len);
+                str = heapbuf.c_str();
+            }
+
+            char* end;
+            value = strto_fp<double>(str, &end, lc);
+            parsed = end != str;
+            while (lc.isspace(*end))
+                end++;
+
+            whole = end == str + len;
+        }
+
+        bool const ok = parsed && whole && errno == 0;
+        if (!parsed || !whole)
+            value = std::numeric_limits<double>::quiet_NaN();
+
+        out[count] = value;
+        if (errors)
+        {
+            auto const bit = (unsigned char)(1u << (count % 8));
+            errors[count / 8] = ok ? errors[count / 8] & ~bit : errors[count / 8] | bit;
+        }
+
+        count++;
+        first = field_end == last ? last : field_end + 1;
+    }
+
+    if (endptr)
+        *endptr = first;
+
+    errno = saved_errno;
+    return count;
+}
+
+template float red::polyloc::strto_fp<float>(const char*, char**, lc_data const&, bool);
+template double red::polyloc::strto_fp<double>(const char*, char**, lc_data const&, bool);
+template long double red::polyloc::strto_fp<long double>(const char*, char**, lc_data const&, bool);
+
+template long red::polyloc::strto_int<long>(const char*, char**, int, lc_data const&, bool);
+template unsigned long red::polyloc::strto_int<unsigned long>(const char*, char**, int, lc_data const&, bool);
+template long long red::polyloc::strto_int<long long>(const char*, char**, int, lc_data const&, bool);
+template unsigned long long red::polyloc::strto_int<unsigned long long>(const char*, char**, int, lc_data const&, bool);
+
+template float red::polyloc::strto_fp<float>(const wchar_t*, wchar_t**, lc_data const&, bool);
+template double red::polyloc::strto_fp<double>(const wchar_t*, wchar_t**, lc_data const&, bool);
+template long double red::polyloc::strto_fp<long double>(const wchar_t*, wchar_t**, lc_data const&, bool);
+
+template long red::polyloc::strto_int<long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+template unsigned long red::polyloc::strto_int<unsigned long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+template long long red::polyloc::strto_int<long long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+template unsigned long long red::polyloc::strto_int<unsigned long long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "polyimpl.h"
+
+namespace red::polyloc
+{
+    struct lc_data;
+
+    // Core of the strtod family, parses like strtod would in the locale described by 'lc':
+    // leading space, sign, decimal or hex floats using the locale's decimal point, inf and nan.
+    // Sets errno to ERANGE when the value doesn't fit in T.
+    // If 'grouped', the locale's thousands separator is skipped between integer digits.
+    // 'CharT' is char or wchar_t, wide input uses the wide punctuation of the locale.
+    template<class T, class CharT>
+    T strto_fp(const CharT* str, CharT** endptr, lc_data const& lc, bool grouped = false);
+
+    // Core of the strtol family: leading space, sign, 0x/0 prefixes when 'base' is 0 (or 16).
+    // Sets errno to ERANGE when the value doesn't fit in T, EINVAL for an invalid base.
+    // If 'grouped', the locale's thousands separator is skipped between base 10 digits.
+    template<class T, class CharT>
+    T strto_int(const CharT* str, CharT** endptr, int base, lc_data const& lc, bool grouped = false);
+
+    // Parses the fields of 'delim' or newline separated text in [first, last) into 'out',
+    // at most 'n' of them. A field must be a whole number (surrounding space allowed),
+    // otherwise its bit in 'errors' is set and it gets NaN, or +-HUGE_VAL on overflow.
+    // Returns the num. of fields, 'endptr' gets where the next field would start.
+    size_t parse_fp_fields(const char* first, const char* last, char delim, double* out, size_t n,
+                           unsigned char* errors, const char** endptr, lc_data const& lc);
+
+    extern template float strto_fp<float>(const char*, char**, lc_data const&, bool);
+    extern template double strto_fp<double>(const char*, char**, lc_data const&, bool);
+    extern template long double strto_fp<long double>(const char*, char**, lc_data const&, bool);
+
+    extern template long strto_int<long>(const char*, char**, int, lc_data const&, bool);
+    extern template unsigned long strto_int<unsigned long>(const char*, char**, int, lc_data const&, bool);
+    extern template long long strto_int<long long>(const char*, char**, int, lc_data const&, bool);
+    extern template unsigned long long strto_int<unsigned long long>(const char*, char**, int, lc_data const&, bool);
+
+    extern template float strto_fp<float>(const wchar_t*, wchar_t**, lc_data const&, bool);
+    extern template double strto_fp<double>(const wchar_t*, wchar_t**, lc_data const&, bool);
+    extern template long double strto_fp<long double>(const wchar_t*, wchar_t**, lc_data const&, bool);
+
+    extern template long strto_int<long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+    extern template unsigned long strto_int<unsigned long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+    extern template long long strto_int<long long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+    extern template unsigned long long strto_int<unsigned long long>(const wchar_t*, wchar_t**, int, lc_data const&, bool);
+}
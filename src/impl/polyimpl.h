@@ -7,9 +7,12 @@
     #include "boost/utility/string_view.hpp"
 #endif
 
+#include <cerrno>
+#include <cstdlib>
+#include <cwchar>
 #include <iosfwd>
-#include <boost/iostreams/stream_buffer.hpp>
-#include <boost/iostreams/device/array.hpp>
+#include <stdexcept>
+#include <type_traits>
 
 
 namespace red
@@ -25,14 +28,6 @@ namespace red
     using boost::basic_string_view;
 #endif
 
-namespace io
-{
-    using namespace boost::iostreams;
-
-    using array_read_buf = stream_buffer< array_source >;
-    using array_buf = stream_buffer<array>;
-}
-
     // string_view to long
     template <class StrView>
     inline long svtol(StrView sv, size_t* pos = 0, int base = 10)
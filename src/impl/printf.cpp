@@ -1,30 +1,37 @@
-﻿// disable deprication warning about wstring_convert
-/*
+﻿/*
   I could use a 3rd-party lib like Boost.Locale, but those usualy accept only a subset of locale
   names like "en_US", "pt_BR.UTF-8"... OR they don't know the fact that MSVC now supports
   utf8 locales https://github.com/MicrosoftDocs/cpp-docs/issues/1469
 */
 
-// MSVC
-#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
-
 #include "printf.hpp"
 #include "printf_fmt.hpp"
+#include "sink.hpp"
+#include "locale.hpp"
+#include "numfmt.hpp"
+#include "wcvt.hpp"
 #include "bitmask.hpp"
-#include <boost/io/ios_state.hpp>
 
-#include <sstream>
-#include <iomanip>
-#include <codecvt>
+#include <ostream>
 #include <algorithm>
-#include <optional>
 #include <cstddef>
 #include <cmath>
 #include <cassert>
+#include <cerrno>
+#include <iterator>
+#include <vector>
 
 
-using std::ios;
 using red::polyloc::fmtspec_t;
+using red::polyloc::compiled_fmt;
+using red::polyloc::compiled_wfmt;
+using red::polyloc::basic_compiled_fmt;
+using red::polyloc::sink;
+using red::polyloc::wsink;
+using red::polyloc::basic_sink;
+using red::polyloc::put_padded;
+using red::polyloc::put_int;
+using red::polyloc::put_fp;
 namespace bm = bitmask;
 using namespace std::literals;
 using namespace bitmask::ops;
@@ -42,68 +49,71 @@ struct va_deleter
     }
 };
 
-// utility wrapper to adapt locale-bound facets for wstring/wbuffer convert
-template<class Facet>
-struct facet_adapter : Facet
+enum class arg_flags : unsigned short
 {
-    using Facet::Facet; // inherit constructors
-    ~facet_adapter() = default;
-};
+    none,
+    wide = 1 << 2,
+    narrow = 1 << 3,
+    quarter = 1 << 4,
 
-using cvt_t = facet_adapter<std::codecvt_byname<wchar_t, char, std::mbstate_t>>;
-using wconverter = std::wstring_convert<cvt_t>;
+    sizefield = wide|narrow|quarter
+};
 
-template<class Ch, class Tr = std::char_traits<Ch>>
-struct ios_saver
+// the arguments of an unnumbered format, taken in order
+struct va_args
 {
-    using state_type = std::basic_ios<Ch, Tr>;
-
-    explicit ios_saver(state_type& s) : m_wpfsaver(s), m_fillsaver(s)
-    {}
-
-    void restore() {
-        m_wpfsaver.restore();
-        m_fillsaver.restore();
-    }
+    va_list* va;
 
-private:
-    boost::io::ios_base_all_saver m_wpfsaver;
-    boost::io::basic_ios_fill_saver<Ch, Tr> m_fillsaver;
+    template<class T>
+    T get(int /*pos*/) { return va_arg(*va, T); }
 };
 
-enum class arg_flags : unsigned short
+// an argument as loaded by its arg_type
+union arg_value
 {
-    none,
-    wide = 1 << 2,
-    narrow = 1<<3,
-    blankpos = 1 << 6,
+    int64_t i;
+    double d;
+    void* p;
+};
 
-    altform = 1 << 9, // ios::showbase for ints, ios::showpoint for floats
+// the arguments of a "%n$" format, all loaded up front, taken by position
+struct table_args
+{
+    const arg_value* values;
 
-    sizefield = wide|narrow
+    template<class T>
+    T get(int pos) const noexcept
+    {
+        auto const& v = values[pos - 1];
+        if constexpr (std::is_floating_point_v<T>)
+            return T(v.d);
+        else if constexpr (std::is_pointer_v<T>)
+            return static_cast<T>(v.p);
+        else
+            return T(v.i);
+    }
 };
 
 
+// prints one argument into a narrow or wide sink, 'Args' is va_args or table_args
+template<class CharT, class Args>
 struct arg_printer
 {
-    arg_printer(fmtspec_t fmts, std::ostream& os_, va_list* pva)
-    : fmtspec(fmts), os(os_), va(pva)
+    arg_printer(fmtspec_t fmts, basic_sink<CharT>& out_, const poly_locale& lc_, Args& args_)
+    : out(out_), lc(lc_), args(args_), fmtspec(fmts)
     {
     }
 
 
-    std::ostream& os;
-    va_list* va;
+    basic_sink<CharT>& out;
+    const poly_locale& lc;
+    Args& args;
     fmtspec_t fmtspec;
-    mutable std::optional<wconverter> conv;
     arg_flags aflags{};
 
     // print value
     auto put()
     {
-        ios_saver<char> _g_(os);
-
-        apply_flags();
         apply_fwpr();
         apply_len();
 
@@ -113,304 +123,252 @@ struct arg_printer
             aflags |= arg_flags::wide;
         case 'c': // char
             if (bm::has(aflags, arg_flags::wide)) {
-                auto v = va_arg(*va, wint_t);
+                auto v = value<wint_t>();
                 wchar_t cp[1] = { (wchar_t)v };
-                put_str({ cp, 1 });
+                put_str(red::wstring_view{ cp, 1 }, false);
             }
             else {
-                auto v = va_arg(*va, int);
+                auto v = value<int>();
                 char cp[1] = { (char)v };
-                put_str({ cp, 1 });
+                put_str(red::string_view{ cp, 1 }, false);
             }
             break;
 
-        case 'u': // Unsigned decimal integer
-            os << std::dec;
-            goto common_uint;
-
         case 'd': // Signed decimal integer
         case 'i':
-            os << std::dec;
-
-            if (bitmask::has(aflags, arg_flags::wide)) {
-                put_int(va_arg(*va, int64_t));
-            }
-            else {
-                put_int(va_arg(*va, int32_t));
-            }
+        {
+            auto v = get_signed();
+            auto mag = v < 0 ? 0 - uint64_t(v) : uint64_t(v);
+            put_int(out, mag, v < 0, fmtspec.conversion, fmtspec.field_width, fmtspec.precision, fmtspec.flagset, lc.data);
             break;
+        }
 
+        case 'u': // Unsigned decimal integer
         case 'o': // Unsigned octal integer
-            os << std::oct;
-            goto common_uint;
-
         case 'X': // Unsigned hexadecimal integer w/ uppercase letters
-            os.setf(ios::uppercase);
         case 'x': // Unsigned hexadecimal integer w/ lowercase letters
-            os << std::hex;
-            goto common_uint;
+            put_int(out, get_unsigned(), false, fmtspec.conversion, fmtspec.field_width, fmtspec.precision, fmtspec.flagset, lc.data);
+            break;
 
         case 'E': // float, scientific notation
-            os.setf(ios::uppercase);
         case 'e':
-            os << std::scientific;
-            put_fp(va_arg(*va, double));
-            break;
-
         case 'F': // float, fixed notation
-            os.setf(ios::uppercase);
         case 'f':
-            os << std::fixed;
-            put_fp(va_arg(*va, double));
-            break;
-
         case 'G': // float, general notation
-            os.setf(ios::uppercase);
         case 'g':
-            os << std::defaultfloat;
-            put_fp(va_arg(*va, double));
-            break;
-
         case 'A': // hex float
-            os.setf(ios::uppercase);
         case 'a':
-            os << std::hexfloat;
-            put_fp(va_arg(*va, double));
+            put_fp(out, value<double>(), fmtspec.conversion, fmtspec.field_width, fmtspec.precision, fmtspec.flagset, lc.data);
             break;
 
         case 'p': // pointer
-            os << std::hex << va_arg(*va, void*);
+        {
+            auto v = (uintptr_t)value<void*>();
+            put_int(out, v, false, 'p', fmtspec.field_width, -1, fmtspec.flagset, lc.data);
             break;
+        }
 
         case 'S': // wide string
             aflags |= arg_flags::wide;
         case 's': // string
             if (bm::has(aflags, arg_flags::wide)) {
-                put_str(va_arg(*va, wchar_t*));
+                auto str = value<wchar_t*>();
+                put_str(str ? red::wstring_view(str) : L"(null)");
             }
             else {
-                put_str(va_arg(*va, char*));
+                auto str = value<char*>();
+                put_str(str ? red::string_view(str) : "(null)");
             }
             break;
 
         case 'n': // weird write-bytes specifier (not implemented)
         default:
             // invalid, print fmt as-is minus %
-            os << fmtspec.fmt.substr(1);
-            break;
-
-            // https://docs.microsoft.com/en-us/cpp/c-runtime-library/format-specification-syntax-printf-and-wprintf-functions?view=vs-2019#argument-size-specification
-            // integer args w/o size spec are treated as 32bit
-        common_uint:
-            if (bitmask::has(aflags, arg_flags::wide)) {
-                auto num = va_arg(*va, uint64_t);
-                put_int(num);
-            }
-            else {
-                auto num = va_arg(*va, uint32_t);
-                put_int(num);
-            }
+            out.widen(fmtspec.fmt.substr(1));
             break;
         }
     }
 
 private:
 
-    void put_fp(double number) const
-    {
-        if (bm::has(aflags, arg_flags::altform)) {
-            os.setf(ios::showpoint);
-        }
-
-        if (bm::has(aflags, arg_flags::blankpos) && number >= 0)
-            os.put(' ');
-
-        if (fmtspec.precision == -1)
-        {
-            os.precision(6);
-        }
-        else if (fmtspec.precision == 0)
-        {
-            number = std::round(number);
-        }
+    // the argument being converted
+    template<class T>
+    T value() const { return args.template get<T>(fmtspec.arg_pos); }
 
-        os << number;
+    // strings of the sink's char type are copied, others are converted w/ the locale.
+    // 'limited' is false for %c %lc, which ignore the precision.
+    void put_str(red::wstring_view str, bool limited = true) const {
+        if constexpr (std::is_same_v<CharT, wchar_t>)
+            put_same(str, limited);
+        else
+            red::polyloc::put_wstr(out, str, fmtspec.field_width, limited ? fmtspec.precision : -1, fmtspec.flagset, lc);
     }
 
-    void put_str(red::wstring_view str) const {
-        if (!conv) {
-            conv.emplace(new cvt_t(os.getloc().name()));
-        }
-        std::string tmp = conv->to_bytes(str.data(), str.data() + str.size());
-        put_str(tmp);
+    void put_str(red::string_view str, bool limited = true) const {
+        if constexpr (std::is_same_v<CharT, char>)
+            put_same(str, limited);
+        else
+            red::polyloc::put_mbstr(out, str, fmtspec.field_width, limited ? fmtspec.precision : -1, fmtspec.flagset, lc);
     }
 
-    void put_str(red::string_view str) const {
-        if (fmtspec.precision > 0)
+    void put_same(red::basic_string_view<CharT> str, bool limited) const {
+        if (limited && fmtspec.precision >= 0)
         {
             str = str.substr(0, fmtspec.precision);
         }
 
-        os << str;
+        put_padded(out, {}, str, fmtspec.field_width, fmtspec.flagset);
     }
 
-    template<class I>
-    using is_int = std::enable_if_t<std::is_integral<I>::value>;
-
-    template<typename T, class = is_int<T>>
-    void put_int(T val) const
+    // https://docs.microsoft.com/en-us/cpp/c-runtime-library/format-specification-syntax-printf-and-wprintf-functions?view=vs-2019#argument-size-specification
+    // integer args w/o size spec are treated as 32bit
+    int64_t get_signed() const
     {
-        if (bm::has(aflags, arg_flags::altform)) {
-            os << std::showbase;
-        }
+        if (bm::has(aflags, arg_flags::wide))
+            return value<int64_t>();
+
+        auto v = value<int32_t>();
+        if (bm::has(aflags, arg_flags::quarter))
+            return (signed char)v;
+        if (bm::has(aflags, arg_flags::narrow))
+            return (short)v;
+        return v;
+    }
 
-        if (bm::has(aflags, arg_flags::blankpos) && val >= 0 && fmtspec.field_width < 2)
-            os.put(' ');
+    uint64_t get_unsigned() const
+    {
+        if (bm::has(aflags, arg_flags::wide))
+            return value<uint64_t>();
+
+        auto v = value<uint32_t>();
+        if (bm::has(aflags, arg_flags::quarter))
+            return (unsigned char)v;
+        if (bm::has(aflags, arg_flags::narrow))
+            return (unsigned short)v;
+        return v;
+    }
 
-        if (fmtspec.precision >= 0 && val == 0)
+    // field width, precision
+    void apply_fwpr()
+    {
+        if (fmtspec.field_width == fmtspec.VAL_VA)
         {
-            if (bitmask::has_all(os.flags(), ios::oct | ios::showbase))
-            {
-                // for octal, if both the converted value and the precision are ​0​, single ​0​ is written.
-                os << 0;
-                return;
-            }
-            else if (!bm::has(os.flags(), ios::showpos))
-            {
-                return;
+            fmtspec.field_width = args.template get<int>(fmtspec.width_pos);
+
+            // a negative width is a '-' flag followed by a positive width
+            if (fmtspec.field_width < 0) {
+                fmtspec.field_width = -fmtspec.field_width;
+                fmtspec.flagset |= red::polyloc::fmt_flags::left;
             }
         }
 
-        if (fmtspec.precision > 0)
+        if (fmtspec.precision == fmtspec.VAL_VA)
         {
-            auto remainingW = fmtspec.field_width - fmtspec.precision;
-            if (remainingW > 0)
-            {
-                char s = ' ';
-                os.width(remainingW);
-                os.fill(s);
-                os << s;
-            }
+            fmtspec.precision = args.template get<int>(fmtspec.precision_pos);
 
-            os.width(fmtspec.precision);
-            os.fill('0');
+            // negative precision is taken as if it was omitted
+            if (fmtspec.precision < 0)
+                fmtspec.precision = fmtspec.VAL_AUTO;
         }
-
-        os << val;
     }
 
-    void apply_flags()
+    void apply_len() noexcept
     {
-        for (auto f : fmtspec.flags)
+        if (fmtspec.length_mod == "h")
         {
-            switch (f)
-            {
-            case '-': // left justify
-                os << std::left;
-                break;
-            case '+': // show positive sign
-                os << std::showpos;
-                break;
-            case ' ': // Use a blank to prefix the output value if it is signed and positive, 
-                aflags |= arg_flags::blankpos;
-                break;
-            case '#':
-                aflags |= arg_flags::altform;
-                break;
-            case '0':
-                os.fill('0');
-                break;
-            default:
-                break;
-            }
+            // halfwidth
+            aflags |= arg_flags::narrow;
         }
-
-        // ' ' has no effect if '+' is set
-        if (bm::has(os.flags(), ios::showpos))
+        else if (fmtspec.length_mod == "hh")
+        {
+            // quarterwidth
+            aflags |= arg_flags::quarter;
+        }
+        // %lc %ls
+        else if (fmtspec.length_mod == "l" && (fmtspec.conversion == 'c' || fmtspec.conversion == 's'))
         {
-            aflags &= ~arg_flags::blankpos;
+            aflags |= arg_flags::wide;
+        }
+        // 64-bit integers, same rule arg_type_of uses for "%n$" formats
+        else if (red::polyloc::is_64bit_size(fmtspec.length_mod))
+        {
+            aflags |= arg_flags::wide;
         }
     }
+};
 
-    // field width, precision
-    void apply_fwpr()
-    {
-        if (fmtspec.field_width == fmtspec.VAL_VA)
-            fmtspec.field_width = va_arg(*va, int);
-
-        if (fmtspec.precision == fmtspec.VAL_VA)
-            fmtspec.precision = va_arg(*va, int);
+// calls 'f' with the cached compiled form of 'format', or with a local one on a nested miss
+template<class CharT, class F>
+auto with_compiled(red::basic_string_view<CharT> format, F&& f)
+{
+    red::polyloc::basic_fmt_lookup<CharT> cached{ format };
+    if (auto* cf = cached.get())
+        return f(*cf);
 
-        os.width(fmtspec.field_width > 0 ? fmtspec.field_width : 0);
-        os.precision(fmtspec.precision > 0 ? fmtspec.precision : 0);
-    }
+    basic_compiled_fmt<CharT> local{ format };
+    return f(local);
+}
 
-    void apply_len() noexcept
+template<class CharT, class Args>
+void print_all(const basic_compiled_fmt<CharT>& format, basic_sink<CharT>& out, const poly_locale& loc, Args& args)
+{
+    for (auto& tok : format)
     {
-        if (!fmtspec.length_mod.empty())
+        if (tok.is_spec)
         {
-            if (fmtspec.length_mod == "h")
-            {
-                // halfwidth
-                aflags |= arg_flags::narrow;
-            }
-            else if (fmtspec.length_mod == "hh")
-            {
-                // quarterwidth
-            }
-            // are we 64-bit (unix style)
-            else if (fmtspec.length_mod == "l")
-            {
-                if (sizeof(long) == 8 || fmtspec.conversion == 'c' || fmtspec.conversion == 's')
-                    aflags |= arg_flags::wide;
-            }
-            else if (fmtspec.length_mod == "ll")
-            {
-                aflags |= arg_flags::wide;
-            }
-            // are we 64-bit on intmax_t? (c99)
-            else if (fmtspec.length_mod == "j")
-            {
-                if (sizeof(size_t) == 8)
-                    aflags |= arg_flags::wide;
-            }
-            // are we 64-bit on size_t or ptrdiff_t? (c99)
-            else if (fmtspec.length_mod == "z" || fmtspec.length_mod == "t")
-            {
-                if (sizeof(ptrdiff_t) == 8)
-                    aflags |= arg_flags::wide;
-            }
-            // are we 64-bit (msft style)
-            else if (fmtspec.length_mod == "I64")
-            {
-                aflags |= arg_flags::wide;
-            }
-            else if (fmtspec.length_mod == "I32")
-            {
-                if (sizeof(void*) == 8)
-                    aflags |= arg_flags::wide;
-            }
+            arg_printer<CharT, Args> pfarg{ tok.spec, out, loc, args };
+            pfarg.put();
+        }
+        else
+        {
+            out.write(tok.text);
         }
     }
-};
+}
 
-} // unnamed
+// loads every argument of a "%n$" format in position order, then prints from the table
+template<class CharT>
+void print_positional(const basic_compiled_fmt<CharT>& format, basic_sink<CharT>& out, const poly_locale& loc, va_list* va)
+{
+    auto const& types = format.arg_types();
+
+    // most messages take a handful of arguments, a long list goes to the heap
+    arg_value local[32];
+    std::vector<arg_value> heap;
+    auto values = local;
+    if (types.size() > std::size(local)) {
+        heap.resize(types.size());
+        values = heap.data();
+    }
 
+    for (size_t i = 0; i < types.size(); i++)
+    {
+        switch (types[i])
+        {
+        case red::polyloc::arg_type::int32: values[i].i = va_arg(*va, int); break;
+        case red::polyloc::arg_type::int64: values[i].i = va_arg(*va, int64_t); break;
+        case red::polyloc::arg_type::dbl: values[i].d = va_arg(*va, double); break;
+        case red::polyloc::arg_type::ptr: values[i].p = va_arg(*va, void*); break;
+        case red::polyloc::arg_type::none: break; // not made by scan_positions
+        }
+    }
 
-int red::polyloc::do_printf(string_view format, std::ostream& outs, const std::locale& loc, va_list args)
-{
-    auto oldloc = outs.imbue(loc);
-    int result = do_printf(format, outs, args);
-    outs.imbue(oldloc);
-    return result;
+    table_args args{ values };
+    print_all(format, out, loc, args);
 }
 
-int red::polyloc::do_printf(string_view fmt, std::ostream& outs, va_list args)
+template<class CharT>
+int printf_impl(const basic_compiled_fmt<CharT>& format, basic_sink<CharT>& out, const poly_locale& loc, va_list args)
 {
-    if (fmt.empty())
+    if (format.source().empty())
         return 0;
 
-    auto loc = outs.getloc();
+    if (!format.args_ok()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    auto const start = out.size();
 
 #ifdef __GNUC__
     va_list va;
@@ -420,59 +378,76 @@ int red::polyloc::do_printf(string_view fmt, std::ostream& outs, va_list args)
     auto va = args;
 #endif // __GNUC__
 
-    auto format = std::string(fmt);
-    fmt_tokenizer toknz{ format };
-
-    for (auto& tok : toknz)
+    if (format.positional())
     {
-        if (tok.size() >= 2 && tok[0] == '%')
-        {
-            auto fmtspec = parsefmt(tok, loc);
-            arg_printer pfarg{ fmtspec, outs, &va };
-            pfarg.put();
-        }
-        else
-        {
-            outs << tok;
-        }
+        print_positional(format, out, loc, &va);
+    }
+    else
+    {
+        va_args in_order{ &va };
+        print_all(format, out, loc, in_order);
     }
 
-    return outs.tellp();
+    return int(out.size() - start);
 }
 
+} // unnamed
 
-auto red::polyloc::do_printf(string_view format, std::ostream& outs, size_t max, va_list va) -> std::pair<int, int>
+
+int red::polyloc::do_printf(string_view format, std::ostream& outs, const std::locale& loc, va_list args)
 {
-    std::pair<int, int> ret;
+    if (format.empty())
+        return 0;
 
-    std::ostringstream tmp;
-    do_printf(format, tmp, va);
-    auto tmpstr = tmp.str();
-    ret.first = tmpstr.size();
+    return with_compiled(format, [&](const compiled_fmt& cf) {
+        return do_printf(cf, outs, loc, args);
+    });
+}
 
-    if (max == 0)
-    {
-        ret.second = 0;
-    }
-    else if (ret.first < max)
-    {
-        ret.second = ret.first;
-        outs << tmpstr;
-    }
-    else
-    {
-        auto to_be_writen = string_view(tmpstr).substr(0, max - 1);
-        ret.second = to_be_writen.size();
-        outs << to_be_writen;
-    }
+int red::polyloc::do_printf(string_view format, std::ostream& outs, va_list args)
+{
+    return do_printf(format, outs, outs.getloc(), args);
+}
+
+int red::polyloc::do_printf(string_view format, sink& out, const poly_locale& loc, va_list args)
+{
+    if (format.empty())
+        return 0;
+
+    return with_compiled(format, [&](const compiled_fmt& cf) {
+        return printf_impl(cf, out, loc, args);
+    });
+}
 
-    return ret;
+int red::polyloc::do_printf(wstring_view format, wsink& out, const poly_locale& loc, va_list args)
+{
+    if (format.empty())
+        return 0;
+
+    return with_compiled(format, [&](const compiled_wfmt& cf) {
+        return printf_impl(cf, out, loc, args);
+    });
+}
+
+
+int red::polyloc::do_printf(const compiled_fmt& format, std::ostream& outs, const std::locale& loc, va_list args)
+{
+    ostream_sink out{ outs };
+    red::polyloc::cached_locale ploc{ loc };
+    return do_printf(format, out, ploc.get(), args);
+}
+
+int red::polyloc::do_printf(const compiled_fmt& format, std::ostream& outs, va_list args)
+{
+    return do_printf(format, outs, outs.getloc(), args);
+}
+
+int red::polyloc::do_printf(const compiled_fmt& format, sink& out, const poly_locale& loc, va_list args)
+{
+    return printf_impl(format, out, loc, args);
 }
 
-auto red::polyloc::do_printf(string_view format, std::ostream& outs, size_t max, const std::locale& loc, va_list args) -> std::pair<int, int>
+int red::polyloc::do_printf(const compiled_wfmt& format, wsink& out, const poly_locale& loc, va_list args)
 {
-    auto oldloc = outs.imbue(loc);
-    auto result = do_printf(format, outs, max, args);
-    outs.imbue(oldloc);
-    return result;
+    return printf_impl(format, out, loc, args);
 }
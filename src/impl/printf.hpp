@@ -7,19 +7,37 @@
 
 #include "polyimpl.h"
 
+struct poly_locale;
+
 
 namespace red { namespace polyloc {
 
+template<class CharT> class basic_compiled_fmt;
+template<class CharT> class basic_sink;
+using compiled_fmt = basic_compiled_fmt<char>;
+using compiled_wfmt = basic_compiled_fmt<wchar_t>;
+using sink = basic_sink<char>;
+using wsink = basic_sink<wchar_t>;
+
 int do_printf(string_view format, std::ostream& outs, va_list args);
 
 int do_printf(string_view format, std::ostream& outs, const std::locale& loc, va_list va);
 
-// Prints at most 'max' chars of the contents of 'args' into 'outs' according to the format string.
-// returns a pair with respectively:
-//  - num. chars needed to write the full contents of args into ostream.
-//  - num. chars written to ostream. In the range [0, max).
-auto do_printf(string_view format, std::ostream& outs, size_t max, va_list args)->std::pair<int, int>;
+// Prints the contents of 'args' into 'out' according to the format string.
+// Returns the num. of chars sent to the sink, a bounded sink may have stored less.
+int do_printf(string_view format, sink& out, const poly_locale& loc, va_list va);
+
+// Wide version, 'out' counts wide chars.
+int do_printf(wstring_view format, wsink& out, const poly_locale& loc, va_list va);
+
+// Same as above, for a format already split by compiled_fmt. The string_view overloads
+// look the format up in the format cache and end up here.
+int do_printf(const compiled_fmt& format, std::ostream& outs, va_list args);
+
+int do_printf(const compiled_fmt& format, std::ostream& outs, const std::locale& loc, va_list va);
+
+int do_printf(const compiled_fmt& format, sink& out, const poly_locale& loc, va_list va);
 
-auto do_printf(string_view format, std::ostream& outs, size_t max, const std::locale& loc, va_list va)->std::pair<int, int>;
+int do_printf(const compiled_wfmt& format, wsink& out, const poly_locale& loc, va_list va);
 
-}} // red::polyloc
\ No newline at end of file
+}} // red::polyloc
@@ -1,38 +1,506 @@
 #pragma once
 
 #include "polyimpl.h"
-#include <boost/tokenizer.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace red::polyloc
 {
-    bool isfmtflag(char ch, bool zero = true, bool space = true);
-    bool isfmttype(char ch);
-    bool isfmtsize(char ch);
-    bool isfmtchar(char ch, bool digits = true);
+    // chars of a printf spec, and a table classifying them
+    namespace fmt_chars
+    {
+        constexpr char FMT_START   = '%';
+        constexpr char FMT_FLAGS[] = "-+#0 '";
+        constexpr char FMT_SIZES[] = "hljztI";
+        constexpr char FMT_TYPES[] = "CcudioXxEeFfGgAapSsn";
+        // precision
+        constexpr char FMT_PRECISION = '.';
+        // value from VA
+        constexpr char FMT_FROM_VA = '*';
+        // ends an argument position, "%2$d" (POSIX)
+        constexpr char FMT_ARG_POS = '$';
+        // highest argument position, NL_ARGMAX of glibc
+        constexpr int FMT_ARG_MAX = 4096;
+
+        // character classes, one byte per char
+        enum : unsigned char
+        {
+            CL_FLAG = 1 << 0,
+            CL_SIZE = 1 << 1,
+            CL_TYPE = 1 << 2,
+            CL_DIGIT = 1 << 3,
+            CL_PRECISION = 1 << 4,
+            CL_FROM_VA = 1 << 5,
+        };
+
+        struct fmt_class_table
+        {
+            unsigned char cls[256] = {};
+
+            constexpr fmt_class_table()
+            {
+                for (auto p = FMT_FLAGS; *p; p++)
+                    cls[(unsigned char)*p] |= CL_FLAG;
+                for (auto p = FMT_SIZES; *p; p++)
+                    cls[(unsigned char)*p] |= CL_SIZE;
+                for (auto p = FMT_TYPES; *p; p++)
+                    cls[(unsigned char)*p] |= CL_TYPE;
+                for (char c = '0'; c <= '9'; c++)
+                    cls[(unsigned char)c] |= CL_DIGIT;
+
+                cls[(unsigned char)FMT_PRECISION] |= CL_PRECISION;
+                cls[(unsigned char)FMT_FROM_VA] |= CL_FROM_VA;
+            }
+
+            // chars past 0xff are never part of a spec
+            template<class CharT>
+            constexpr bool is(CharT ch, unsigned char mask) const noexcept {
+                auto c = std::make_unsigned_t<CharT>(ch);
+                return c <= 0xff && (cls[c] & mask) != 0;
+            }
+        };
 
-    struct fmt_separator
+        inline constexpr fmt_class_table FMT_CLASS;
+
+        // skips chars of class 'mask'
+        template<class CharT>
+        constexpr const CharT* skip(const CharT* p, const CharT* last, unsigned char mask) noexcept
+        {
+            while (p != last && FMT_CLASS.is(*p, mask))
+                p++;
+            return p;
+        }
+
+        // skips a "digits$" argument position, if there's one at 'p'
+        template<class CharT>
+        constexpr const CharT* skip_arg_pos(const CharT* p, const CharT* last) noexcept
+        {
+            auto const digits_end = skip(p, last, CL_DIGIT);
+            if (digits_end != p && digits_end != last && *digits_end == FMT_ARG_POS)
+                return digits_end + 1;
+            return p;
+        }
+    }
+
+    constexpr bool isfmtflag(char ch, bool zero = true, bool space = true) noexcept
     {
-        using iterator = std::string::const_iterator;
+        if (ch == '0')
+            return zero;
+        if (ch == ' ')
+            return space;
+
+        return fmt_chars::FMT_CLASS.is(ch, fmt_chars::CL_FLAG);
+    }
+
+    constexpr bool isfmttype(char ch) noexcept { return fmt_chars::FMT_CLASS.is(ch, fmt_chars::CL_TYPE); }
+    constexpr bool isfmtsize(char ch) noexcept { return fmt_chars::FMT_CLASS.is(ch, fmt_chars::CL_SIZE); }
+
+    constexpr bool isfmtchar(char ch, bool digits = true) noexcept
+    {
+        using namespace fmt_chars;
+        return FMT_CLASS.is(ch, CL_PRECISION | CL_FROM_VA | CL_SIZE | CL_TYPE) ||
+            isfmtflag(ch, digits) || (digits && FMT_CLASS.is(ch, CL_DIGIT));
+    }
+
+    // Scans the token starting at 'first': a literal run up to the next '%', or a
+    // whole conversion spec. Sets 'token' to a slice of [first, last) and returns
+    // the position following it ('last' when nothing is left).
+    // Escaped "%%" produce the 1 char token "%", a lone '%' at the end produces nothing.
+    // Specs are made of ASCII chars only, for any 'CharT'.
+    template<class CharT>
+    constexpr const CharT* scan_fmt_token(const CharT* first, const CharT* last, basic_string_view<CharT>& token) noexcept
+    {
+        using namespace fmt_chars;
+
+        if (first == last) {
+            token = {};
+            return last;
+        }
+
+        if (*first != FMT_START)
+        {
+            // literal run, memchr/wmemchr are vectorized by every libc we care about
+            auto next = std::char_traits<CharT>::find(first, size_t(last - first), CharT(FMT_START));
+            if (!next)
+                next = last;
+
+            token = { first, size_t(next - first) };
+            return next;
+        }
+
+        auto p = first + 1;
+        if (p == last) {
+            // lone % at the end
+            token = {};
+            return last;
+        }
+
+        if (*p == FMT_START) {
+            // escaped %
+            token = { p, 1 };
+            return p + 1;
+        }
+
+        // %[n$][flags][width][.precision][size]type, '*' may be '*m$'
+        p = skip_arg_pos(p, last);
+        p = skip(p, last, CL_FLAG);
 
-        bool operator() (iterator& next, iterator end, std::string& token);
-        void reset();
+        if (p != last && *p == FMT_FROM_VA)
+            p = skip_arg_pos(p + 1, last);
+        else
+            p = skip(p, last, CL_DIGIT);
+
+        if (p != last && *p == FMT_PRECISION)
+        {
+            p++;
+            if (p != last && *p == FMT_FROM_VA)
+                p = skip_arg_pos(p + 1, last);
+            else
+                p = skip(p, last, CL_DIGIT);
+        }
+
+        while (p != last && FMT_CLASS.is(*p, CL_SIZE))
+        {
+            if (*p++ == 'I') // I32, I64
+                p = skip(p, last, CL_DIGIT);
+        }
+
+        if (p != last && FMT_CLASS.is(*p, CL_TYPE))
+            p++;
+
+        token = { first, size_t(p - first) };
+        return p;
+    }
+
+    // Same as above for a scanf format, where "%%" is a conversion and "%[...]" a spec.
+    template<class CharT>
+    const CharT* scan_scanf_token(const CharT* first, const CharT* last, basic_string_view<CharT>& token) noexcept;
+
+    extern template const char* scan_scanf_token(const char*, const char*, string_view&) noexcept;
+    extern template const wchar_t* scan_scanf_token(const wchar_t*, const wchar_t*, wstring_view&) noexcept;
+
+    // Splits a format string into literal runs and conversion specs.
+    // Tokens are slices of the scanned string, nothing is copied or allocated.
+    template<class CharT>
+    class basic_fmt_tokenizer
+    {
+    public:
+        using string_view_type = basic_string_view<CharT>;
+
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = string_view_type;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const string_view_type*;
+            using reference = const string_view_type&;
+
+            iterator() = default;
+            iterator(const CharT* first, const CharT* last) noexcept : m_next(first), m_last(last) {
+                ++*this;
+            }
+
+            reference operator* () const noexcept { return m_tok; }
+            pointer operator-> () const noexcept { return &m_tok; }
+
+            iterator& operator++ () noexcept {
+                if (m_next == m_last) {
+                    m_next = m_last = nullptr; // end
+                }
+                else {
+                    m_next = scan_fmt_token(m_next, m_last, m_tok);
+                    if (m_tok.empty())
+                        m_next = m_last = nullptr;
+                }
+                return *this;
+            }
+            iterator operator++ (int) noexcept {
+                auto old = *this;
+                ++*this;
+                return old;
+            }
+
+            bool operator== (iterator const& rhs) const noexcept { return m_next == rhs.m_next && m_last == rhs.m_last; }
+            bool operator!= (iterator const& rhs) const noexcept { return !(*this == rhs); }
+
+        private:
+            const CharT* m_next = nullptr;
+            const CharT* m_last = nullptr;
+            string_view_type m_tok;
+        };
+
+        explicit basic_fmt_tokenizer(string_view_type format) noexcept : m_fmt(format) {}
+
+        iterator begin() const noexcept { return { m_fmt.data(), m_fmt.data() + m_fmt.size() }; }
+        iterator end() const noexcept { return {}; }
 
     private:
-        bool m_infmt = false;
+        string_view_type m_fmt;
     };
 
-    using fmt_tokenizer = boost::tokenizer<fmt_separator, fmt_separator::iterator>;
+    using fmt_tokenizer = basic_fmt_tokenizer<char>;
+    using wfmt_tokenizer = basic_fmt_tokenizer<wchar_t>;
 
-    // %[flags][width][.precision][size]type
+    // printf flags, parsed from fmtspec_t::flags
+    enum class fmt_flags : unsigned char
+    {
+        none,
+        left = 1 << 0,   // '-'
+        plus = 1 << 1,   // '+'
+        space = 1 << 2,  // ' '
+        alt = 1 << 3,    // '#'
+        zero = 1 << 4,   // '0'
+        group = 1 << 5,  // '\'' (POSIX), thousands grouping
+        suppress = 1 << 6, // '*' (scanf), convert but don't assign
+    };
+
+    constexpr fmt_flags parseflags(string_view flags) noexcept
+    {
+        unsigned set = 0;
+
+        for (auto f : flags)
+        {
+            switch (f)
+            {
+            case '-': set |= unsigned(fmt_flags::left); break;
+            case '+': set |= unsigned(fmt_flags::plus); break;
+            case ' ': set |= unsigned(fmt_flags::space); break;
+            case '#': set |= unsigned(fmt_flags::alt); break;
+            case '0': set |= unsigned(fmt_flags::zero); break;
+            case '\'': set |= unsigned(fmt_flags::group); break;
+            default: break;
+            }
+        }
+
+        // ' ' has no effect if '+' is set
+        if (set & unsigned(fmt_flags::plus))
+            set &= ~unsigned(fmt_flags::space);
+
+        return fmt_flags(set);
+    }
+
+    // %[n$][flags][width][.precision][size]type
     struct fmtspec_t
     {
         red::string_view fmt;
         red::string_view flags, length_mod;
         int field_width = -1, precision = -1;
+        // 1-based "n$" positions of the value and of '*' width / precision, 0 if unnumbered
+        int arg_pos = 0, width_pos = 0, precision_pos = 0;
         char conversion = '\030';
+        fmt_flags flagset = fmt_flags::none;
+
+        static constexpr int VAL_VA = -(int)fmt_chars::FMT_FROM_VA, VAL_AUTO = -1;
+    };
+
+    // 'spec' is a whole spec as split by scan_fmt_token, e.g. "%-10.3lf".
+    // constexpr so formats known at compile time are parsed by the compiler (see polyformat.hpp).
+    constexpr fmtspec_t parsefmt(string_view spec) noexcept
+    {
+        using namespace fmt_chars;
+        fmtspec_t fmtspec{ spec };
+
+        auto const at = [spec](size_t i) { return i < spec.size() ? spec[i] : '\0'; };
+        // digits from 'pos', capped so nonsense widths can't overflow
+        auto const number = [&](size_t& pos) {
+            int n = 0;
+            for (; FMT_CLASS.is(at(pos), CL_DIGIT); pos++)
+                n = n < 100000000 ? n * 10 + (at(pos) - '0') : n;
+            return n;
+        };
+        // a "digits$" position, or 0 leaving 'pos' alone
+        auto const arg_position = [&](size_t& pos) {
+            auto end = pos;
+            auto n = number(end);
+            if (end == pos || at(end) != FMT_ARG_POS)
+                return 0;
+            pos = end + 1;
+            return n;
+        };
+
+        size_t pos = 1;
+        fmtspec.arg_pos = arg_position(pos);
+
+        // Flags
+        auto const flags_start = pos;
+        while (FMT_CLASS.is(at(pos), CL_FLAG))
+            pos++;
+        fmtspec.flags = spec.substr(flags_start, pos - flags_start);
+        fmtspec.flagset = parseflags(fmtspec.flags);
+
+        // field width
+        if (at(pos) == FMT_FROM_VA)
+        {
+            fmtspec.field_width = fmtspec_t::VAL_VA;
+            pos++;
+            fmtspec.width_pos = arg_position(pos);
+        }
+        else if (FMT_CLASS.is(at(pos), CL_DIGIT))
+        {
+            fmtspec.field_width = number(pos);
+        }
+
+        // precision, a lone '.' means 0
+        if (at(pos) == FMT_PRECISION)
+        {
+            pos++;
+            if (at(pos) == FMT_FROM_VA)
+            {
+                fmtspec.precision = fmtspec_t::VAL_VA;
+                pos++;
+                fmtspec.precision_pos = arg_position(pos);
+            }
+            else
+            {
+                fmtspec.precision = number(pos);
+            }
+        }
+
+        // size overrides
+        auto const size_start = pos;
+        if (at(pos) == 'I')
+        {
+            // I, I32, I64
+            pos++;
+            while (at(pos) == '3' || at(pos) == '2' || at(pos) == '6' || at(pos) == '4')
+                pos++;
+        }
+        else
+        {
+            while (FMT_CLASS.is(at(pos), CL_SIZE))
+                pos++;
+        }
+        fmtspec.length_mod = spec.substr(size_start, pos - size_start);
+
+        // conversion spec
+        if (FMT_CLASS.is(at(pos), CL_TYPE))
+            fmtspec.conversion = at(pos);
+
+        return fmtspec;
+    }
+
+    // true if an integer w/ the 'length_mod' size is passed as 64 bits
+    constexpr bool is_64bit_size(string_view length_mod) noexcept
+    {
+        if (length_mod == "l")
+            return sizeof(long) == 8;
+        if (length_mod == "ll" || length_mod == "I64")
+            return true;
+        if (length_mod == "j")
+            return sizeof(intmax_t) == 8;
+        if (length_mod == "z" || length_mod == "t")
+            return sizeof(ptrdiff_t) == 8;
+        if (length_mod == "I")
+            return sizeof(void*) == 8;
+        return false;
+    }
+
+    // how the argument of a conversion goes through '...'
+    enum class arg_type : unsigned char { none, int32, int64, dbl, ptr };
+
+    constexpr arg_type arg_type_of(fmtspec_t const& spec) noexcept
+    {
+        switch (spec.conversion)
+        {
+        case 'c': case 'C': // int or wint_t
+            return arg_type::int32;
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            return is_64bit_size(spec.length_mod) ? arg_type::int64 : arg_type::int32;
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            return arg_type::dbl;
+        case 'p': case 's': case 'S': case 'n':
+            return arg_type::ptr;
+        default:
+            return arg_type::none;
+        }
+    }
+
+    // %[*]['][width][size]type of scanf. The set of a "%[" conversion is left in 'fmt',
+    // "%%" gives the conversion '%'.
+    fmtspec_t parsescanfmt(string_view fmt);
+
+    enum class fmt_kind : unsigned char { print, scan };
+
+    // A format string split once into literal runs and parsed conversion specs.
+    // Owns a copy of the format, so it stays valid after the caller's string is gone.
+    // The specs of a wide format are parsed from a narrow copy, fmtspec_t is always char.
+    template<class CharT>
+    class basic_compiled_fmt
+    {
+    public:
+        using string_view_type = basic_string_view<CharT>;
+
+        struct token
+        {
+            string_view_type text; // literal run or the whole spec, e.g. "%10.5d"
+            fmtspec_t spec;
+            bool is_spec = false;
+        };
+
+        explicit basic_compiled_fmt(string_view_type format, fmt_kind kind = fmt_kind::print);
+        basic_compiled_fmt(basic_compiled_fmt const&) = delete;
+        basic_compiled_fmt& operator= (basic_compiled_fmt const&) = delete;
+
+        string_view_type source() const noexcept { return m_source; }
+        // address of the format this was compiled from, used as the cache key
+        const CharT* origin() const noexcept { return m_origin; }
+        fmt_kind kind() const noexcept { return m_kind; }
+
+        auto begin() const noexcept { return m_tokens.begin(); }
+        auto end() const noexcept { return m_tokens.end(); }
+
+        // true for a printf format using "%n$" argument positions
+        bool positional() const noexcept { return !m_arg_types.empty(); }
+        // the type of each argument by position, so they can be loaded in one pass
+        const std::vector<arg_type>& arg_types() const noexcept { return m_arg_types; }
+        // false if the positions can't be honored: numbered and unnumbered specs mixed,
+        // or an argument used as 2 different types
+        bool args_ok() const noexcept { return m_args_ok; }
 
-        static const int VAL_VA, VAL_AUTO = -1;
+    private:
+        void scan_positions();
+
+        const std::basic_string<CharT> m_source;
+        const CharT* m_origin;
+        const fmt_kind m_kind;
+        std::string m_narrow_specs; // wide formats only
+        std::vector<token> m_tokens;
+        std::vector<arg_type> m_arg_types;
+        bool m_args_ok = true;
+    };
+
+    using compiled_fmt = basic_compiled_fmt<char>;
+    using compiled_wfmt = basic_compiled_fmt<wchar_t>;
+
+    extern template class basic_compiled_fmt<char>;
+    extern template class basic_compiled_fmt<wchar_t>;
+
+    // Finds 'format' in this thread's format cache, compiling it on a miss, which may replace
+    // an older entry. The entry stays valid while this is alive. A nested lookup (e.g. printf
+    // to an ostream whose streambuf calls printf) can't replace entries, get() is null if it
+    // misses and the caller compiles locally.
+    template<class CharT>
+    class basic_fmt_lookup
+    {
+    public:
+        explicit basic_fmt_lookup(basic_string_view<CharT> format, fmt_kind kind = fmt_kind::print);
+        ~basic_fmt_lookup();
+        basic_fmt_lookup(basic_fmt_lookup const&) = delete;
+        basic_fmt_lookup& operator= (basic_fmt_lookup const&) = delete;
+
+        const basic_compiled_fmt<CharT>* get() const noexcept { return m_fmt; }
+
+    private:
+        const basic_compiled_fmt<CharT>* m_fmt;
     };
 
-    fmtspec_t parsefmt(string_view fmt, std::locale const& locale);
-}
\ No newline at end of file
+    extern template class basic_fmt_lookup<char>;
+    extern template class basic_fmt_lookup<wchar_t>;
+}
@@ -0,0 +1,712 @@
+#include "scanf.hpp"
+#include "printf_fmt.hpp"
+#include "locale.hpp"
+#include "numparse.hpp"
+#include "sink.hpp"
+#include "wcvt.hpp"
+#include "bitmask.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+
+using red::polyloc::fmtspec_t;
+using red::polyloc::fmt_flags;
+using red::polyloc::compiled_fmt;
+using red::polyloc::lc_data;
+namespace bm = bitmask;
+
+namespace
+{
+
+struct va_deleter
+{
+    using pointer = va_list*;
+
+    void operator () (pointer va) const {
+        va_end(*va);
+    }
+};
+
+// input of sscanf
+class string_source
+{
+public:
+    explicit string_source(const char* str) noexcept : m_begin(str), m_pos(str) {}
+
+    int peek() const noexcept { return *m_pos ? (unsigned char)*m_pos : EOF; }
+    void advance() noexcept { m_pos++; }
+    size_t consumed() const noexcept { return size_t(m_pos - m_begin); }
+
+private:
+    const char* m_begin;
+    const char* m_pos;
+};
+
+// input of fscanf, holds the FILE's lock. The one char of lookahead is put back when done.
+class file_source
+{
+public:
+    explicit file_source(FILE* file) noexcept : m_file(file)
+    {
+#if defined(_MSC_VER)
+        _lock_file(m_file);
+#else
+        flockfile(m_file);
+#endif
+    }
+
+    ~file_source()
+    {
+        if (m_ahead != NONE && m_ahead != EOF)
+            std::ungetc(m_ahead, m_file);
+
+#if defined(_MSC_VER)
+        _unlock_file(m_file);
+#else
+        funlockfile(m_file);
+#endif
+    }
+
+    file_source(file_source const&) = delete;
+    file_source& operator= (file_source const&) = delete;
+
+    int peek() noexcept
+    {
+        if (m_ahead == NONE)
+        {
+#if defined(_MSC_VER)
+            m_ahead = _getc_nolock(m_file);
+#else
+            m_ahead = getc_unlocked(m_file);
+#endif
+        }
+        return m_ahead;
+    }
+
+    void advance() noexcept
+    {
+        peek();
+        m_ahead = NONE;
+        m_count++;
+    }
+
+    size_t consumed() const noexcept { return m_count; }
+
+private:
+    static constexpr int NONE = EOF - 1;
+
+    FILE* m_file;
+    int m_ahead = NONE;
+    size_t m_count = 0;
+};
+
+// the chars of one field, on the stack unless it's a long one
+class field_buffer
+{
+public:
+    void push(char ch)
+    {
+        if (m_size < sizeof m_stack - 1)
+            m_stack[m_size] = ch;
+        else
+        {
+            if (m_heap.empty())
+                m_heap.assign(m_stack, m_size);
+            m_heap += ch;
+        }
+        m_size++;
+    }
+
+    const char* c_str() noexcept
+    {
+        if (!m_heap.empty())
+            return m_heap.c_str();
+
+        m_stack[m_size] = '\0';
+        return m_stack;
+    }
+
+    size_t size() const noexcept { return m_size; }
+
+    void pop() noexcept
+    {
+        if (!m_heap.empty())
+            m_heap.pop_back();
+        m_size--;
+    }
+
+private:
+    char m_stack[128];
+    std::string m_heap;
+    size_t m_size = 0;
+};
+
+bool isdigit10(int ch) noexcept
+{
+    return unsigned(ch - '0') < 10;
+}
+
+// value of 'ch' as a base 36 digit, 36 or more if it isn't one
+unsigned digit_value(int ch) noexcept
+{
+    if (isdigit10(ch))
+        return unsigned(ch - '0');
+
+    auto letter = unsigned((ch | 0x20) - 'a');
+    return letter < 26 ? letter + 10 : 36;
+}
+
+// which chars a %[ conversion takes
+struct scan_set
+{
+    bool in[256] = {};
+
+    // 'spec' is the whole conversion, e.g. "%5[^]a-z]", w/ the closing ']' last
+    explicit scan_set(red::string_view spec) noexcept
+    {
+        auto p = spec.find('[') + 1;
+        auto const last = spec.size() - 1;
+        bool const negate = p < last && spec[p] == '^';
+        p += negate;
+
+        // a ']' right at the start is a member, the scan stops at 'last'
+        for (; p < last; p++)
+        {
+            auto const lo = (unsigned char)spec[p];
+
+            // "a-z" is a range, a '-' at either end is itself
+            if (p + 2 < last && spec[p + 1] == '-' && lo <= (unsigned char)spec[p + 2])
+            {
+                for (unsigned c = lo; c <= (unsigned char)spec[p + 2]; c++)
+                    in[c] = true;
+                p += 2;
+            }
+            else
+            {
+                in[lo] = true;
+            }
+        }
+
+        if (negate)
+        {
+            for (auto& b : in)
+                b = !b;
+        }
+    }
+
+    bool has(int ch) const noexcept { return ch != EOF && in[(unsigned char)ch]; }
+};
+
+enum class scan_result { ok, input_failure, matching_failure };
+
+template<class Source>
+class arg_scanner
+{
+public:
+    arg_scanner(Source& in_, const poly_locale& lc_, va_list* pva)
+    : in(in_), lc(lc_), va(pva)
+    {
+    }
+
+    void skip_space()
+    {
+        while (in.peek() != EOF && lc.data.isspace(char(in.peek())))
+            in.advance();
+    }
+
+    // matches a literal run of the format
+    scan_result match(red::string_view text)
+    {
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            // space in the format matches any amount of it, none included
+            if (lc.data.isspace(text[i]))
+            {
+                skip_space();
+                continue;
+            }
+
+            if (in.peek() == EOF)
+                return scan_result::input_failure;
+            if (in.peek() != (unsigned char)text[i])
+                return scan_result::matching_failure;
+
+            in.advance();
+        }
+
+        return scan_result::ok;
+    }
+
+    scan_result get(fmtspec_t const& spec)
+    {
+        fmtspec = spec;
+        suppress = bm::has(fmtspec.flagset, fmt_flags::suppress);
+        width = fmtspec.field_width > 0 ? size_t(fmtspec.field_width) : SIZE_MAX;
+
+        char conv = fmtspec.conversion;
+        if (conv == 'C' || conv == 'S')
+        {
+            conv = char(conv | 0x20);
+            fmtspec.length_mod = "l";
+        }
+
+        if (conv == 'n')
+        {
+            if (!suppress)
+                store_signed((long long)in.consumed());
+            return scan_result::ok;
+        }
+
+        if (conv != '[' && conv != 'c')
+            skip_space();
+
+        if (in.peek() == EOF)
+            return scan_result::input_failure;
+
+        switch (conv)
+        {
+        case '%':
+            if (in.peek() != '%')
+                return scan_result::matching_failure;
+            in.advance();
+            return scan_result::ok;
+
+        case 'd':
+            return get_int(10, true);
+        case 'i':
+            return get_int(0, true);
+        case 'u':
+            return get_int(10, false);
+        case 'o':
+            return get_int(8, false);
+        case 'x':
+        case 'X':
+            return get_int(16, false);
+        case 'p':
+            return get_int(16, false, true);
+
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            return get_fp();
+
+        case 'c':
+            if (fmtspec.field_width <= 0)
+                width = 1;
+            return get_str([](int) { return true; }, false);
+
+        case 's':
+            return get_str([this](int ch) { return !lc.data.isspace(char(ch)); }, true);
+
+        case '[':
+        {
+            if (fmtspec.fmt.back() != ']')
+                return scan_result::matching_failure;
+
+            scan_set const set{ fmtspec.fmt };
+            return get_str([&set](int ch) { return set.has(ch); }, true);
+        }
+
+        default:
+            // invalid conversion
+            return scan_result::matching_failure;
+        }
+    }
+
+    bool assigns() const noexcept { return !suppress && fmtspec.conversion != '%' && fmtspec.conversion != 'n'; }
+
+private:
+    Source& in;
+    const poly_locale& lc;
+    va_list* va;
+    fmtspec_t fmtspec;
+    bool suppress = false;
+    size_t width = SIZE_MAX;
+
+    bool more() { return width > 0 && in.peek() != EOF; }
+
+    void take(field_buffer& buf)
+    {
+        buf.push(char(in.peek()));
+        in.advance();
+        width--;
+    }
+
+    bool grouped() const noexcept { return bm::has(fmtspec.flagset, fmt_flags::group); }
+
+    // reads the longest prefix of an integer in 'base' (0 detects it). Like glibc, the field
+    // only has to start w/ a number: "0x" reads as 0, the "x" is consumed
+    scan_result get_int(int base, bool is_signed, bool pointer = false)
+    {
+        field_buffer buf;
+        auto const sep = grouped() && *lc.data.grouping ? (unsigned char)lc.data.thousands_sep : EOF;
+        int actual = base;
+
+        if (more() && (in.peek() == '+' || in.peek() == '-'))
+            take(buf);
+
+        if ((base == 0 || base == 16) && more() && in.peek() == '0')
+        {
+            take(buf);
+            if (more() && (in.peek() | 0x20) == 'x')
+            {
+                take(buf);
+                actual = 16;
+            }
+            else if (base == 0)
+            {
+                actual = 8;
+            }
+        }
+        else if (base == 0)
+        {
+            actual = 10;
+        }
+
+        bool digit = false;
+        while (more())
+        {
+            auto const ch = in.peek();
+            if (digit_value(ch) < unsigned(actual))
+                digit = true;
+            else if (!(actual == 10 && ch == sep && digit))
+                break;
+
+            take(buf);
+        }
+
+        char* end;
+        auto const str = buf.c_str();
+
+        if (is_signed)
+        {
+            auto v = red::polyloc::strto_int<long long>(str, &end, base, lc.data, grouped());
+            if (end == str)
+                return scan_result::matching_failure;
+            if (!suppress)
+                store_signed(v);
+        }
+        else
+        {
+            auto v = red::polyloc::strto_int<unsigned long long>(str, &end, base, lc.data, grouped());
+            if (end == str)
+                return scan_result::matching_failure;
+            if (!suppress && pointer)
+                *va_arg(*va, void**) = (void*)(std::uintptr_t)v;
+            else if (!suppress)
+                store_unsigned(v);
+        }
+
+        return scan_result::ok;
+    }
+
+    // reads the longest prefix of a float, same leniency as get_int: "1e" reads as 1
+    scan_result get_fp()
+    {
+        field_buffer buf;
+        auto const dp = (unsigned char)lc.data.decimal_point;
+        auto const sep = grouped() && *lc.data.grouping ? (unsigned char)lc.data.thousands_sep : EOF;
+
+        if (more() && (in.peek() == '+' || in.peek() == '-'))
+            take(buf);
+
+        auto const take_word = [&](const char* word) {
+            for (; *word && more() && (in.peek() | 0x20) == *word; word++)
+                take(buf);
+        };
+
+        if (more() && (in.peek() | 0x20) == 'i')
+        {
+            take_word("infinity");
+        }
+        else if (more() && (in.peek() | 0x20) == 'n')
+        {
+            take_word("nan");
+            if (more() && in.peek() == '(')
+            {
+                take(buf);
+                while (more() && (digit_value(in.peek()) < 36 || in.peek() == '_'))
+                    take(buf);
+                if (more() && in.peek() == ')')
+                    take(buf);
+            }
+        }
+        else
+        {
+            bool hex = false, digit = false;
+            if (more() && in.peek() == '0')
+            {
+                take(buf);
+                digit = true;
+                if (more() && (in.peek() | 0x20) == 'x')
+                {
+                    take(buf);
+                    hex = true;
+                    digit = false;
+                }
+            }
+
+            auto const base = hex ? 16u : 10u;
+
+            while (more() && (digit_value(in.peek()) < base || (!hex && in.peek() == sep && digit)))
+            {
+                digit = true;
+                take(buf);
+            }
+
+            if (more() && in.peek() == dp)
+            {
+                take(buf);
+                while (more() && digit_value(in.peek()) < base)
+                    take(buf);
+            }
+
+            if (more() && (in.peek() | 0x20) == (hex ? 'p' : 'e'))
+            {
+                take(buf);
+                if (more() && (in.peek() == '+' || in.peek() == '-'))
+                    take(buf);
+                while (more() && isdigit10(in.peek()))
+                    take(buf);
+            }
+        }
+
+        char* end;
+        auto const str = buf.c_str();
+        auto const& lcd = lc.data;
+
+        if (fmtspec.length_mod == "L")
+        {
+            auto v = red::polyloc::strto_fp<long double>(str, &end, lcd, grouped());
+            if (end == str)
+                return scan_result::matching_failure;
+            if (!suppress)
+                *va_arg(*va, long double*) = v;
+        }
+        else if (fmtspec.length_mod == "l")
+        {
+            auto v = red::polyloc::strto_fp<double>(str, &end, lcd, grouped());
+            if (end == str)
+                return scan_result::matching_failure;
+            if (!suppress)
+                *va_arg(*va, double*) = v;
+        }
+        else
+        {
+            auto v = red::polyloc::strto_fp<float>(str, &end, lcd, grouped());
+            if (end == str)
+                return scan_result::matching_failure;
+            if (!suppress)
+                *va_arg(*va, float*) = v;
+        }
+
+        return scan_result::ok;
+    }
+
+    // %c %s %[, 'terminate' adds the null. 'l' stores wide chars, decoded w/ the locale.
+    template<class Pred>
+    scan_result get_str(Pred&& accept, bool terminate)
+    {
+        bool const wide = fmtspec.length_mod == "l";
+        bool const exact = !terminate; // %c wants exactly 'width' chars
+
+        if (!wide)
+        {
+            char* dest = suppress ? nullptr : va_arg(*va, char*);
+            size_t n = 0;
+
+            for (; more() && accept(in.peek()); n++)
+            {
+                if (dest)
+                    dest[n] = char(in.peek());
+                in.advance();
+                width--;
+            }
+
+            if (n == 0 || (exact && width > 0))
+                return n == 0 && in.peek() != EOF ? scan_result::matching_failure : scan_result::input_failure;
+
+            if (dest && terminate)
+                dest[n] = '\0';
+
+            return scan_result::ok;
+        }
+
+        // width counts chars for %lc, bytes otherwise. A char is a wide char put_mbstr writes,
+        // so each invalid byte counts as the U+FFFD it becomes.
+        field_buffer buf;
+        size_t chars = 0;
+
+        while (in.peek() != EOF && accept(in.peek()))
+        {
+            if (!exact && width == 0)
+                break;
+
+            buf.push(char(in.peek()));
+            if (exact)
+            {
+                auto const decoded = red::polyloc::wide_length({ buf.c_str(), buf.size() }, lc);
+                if (decoded > width) {
+                    buf.pop();
+                    break;
+                }
+                chars = decoded;
+            }
+
+            in.advance();
+            if (!exact)
+                width--;
+        }
+
+        if (buf.size() == 0 || (exact && chars < width))
+            return buf.size() == 0 && in.peek() != EOF ? scan_result::matching_failure : scan_result::input_failure;
+
+        if (!suppress)
+        {
+            // %lc gets exactly 'width' chars. Otherwise never more wide chars than bytes (2 for
+            // a 4 byte sequence w/ UTF-16), so the field width bounds it + the null.
+            auto const field = fmtspec.field_width > 0 ? size_t(fmtspec.field_width) : SIZE_MAX;
+            auto const room = exact ? chars : std::min(buf.size(), field);
+            auto dest = va_arg(*va, wchar_t*);
+            red::polyloc::wbounded_sink out{ dest, room + 1 };
+            red::polyloc::put_mbstr(out, { buf.c_str(), buf.size() }, 0, -1, fmt_flags::none, lc);
+            if (terminate)
+                out.finish();
+        }
+
+        return scan_result::ok;
+    }
+
+    void store_signed(long long v)
+    {
+        auto const& len = fmtspec.length_mod;
+
+        if (len == "hh")
+            *va_arg(*va, signed char*) = (signed char)v;
+        else if (len == "h")
+            *va_arg(*va, short*) = (short)v;
+        else if (len == "l")
+            *va_arg(*va, long*) = (long)v;
+        else if (len == "ll" || len == "L" || len == "I64")
+            *va_arg(*va, long long*) = v;
+        else if (len == "j")
+            *va_arg(*va, intmax_t*) = (intmax_t)v;
+        else if (len == "z" || len == "t" || len == "I")
+            *va_arg(*va, ptrdiff_t*) = (ptrdiff_t)v;
+        else if (len == "I32")
+            *va_arg(*va, int32_t*) = (int32_t)v;
+        else
+            *va_arg(*va, int*) = (int)v;
+    }
+
+    void store_unsigned(unsigned long long v)
+    {
+        auto const& len = fmtspec.length_mod;
+
+        if (len == "hh")
+            *va_arg(*va, unsigned char*) = (unsigned char)v;
+        else if (len == "h")
+            *va_arg(*va, unsigned short*) = (unsigned short)v;
+        else if (len == "l")
+            *va_arg(*va, unsigned long*) = (unsigned long)v;
+        else if (len == "ll" || len == "L" || len == "I64")
+            *va_arg(*va, unsigned long long*) = v;
+        else if (len == "j")
+            *va_arg(*va, uintmax_t*) = (uintmax_t)v;
+        else if (len == "z" || len == "t" || len == "I")
+            *va_arg(*va, size_t*) = (size_t)v;
+        else if (len == "I32")
+            *va_arg(*va, uint32_t*) = (uint32_t)v;
+        else
+            *va_arg(*va, unsigned*) = (unsigned)v;
+    }
+};
+
+template<class Source>
+int scan_impl(const compiled_fmt& format, Source& in, const poly_locale& loc, va_list args)
+{
+#ifdef __GNUC__
+    va_list va;
+    va_copy(va, args);
+    auto _g_ = std::unique_ptr<va_list, va_deleter>(&va);
+#else
+    auto va = args;
+#endif // __GNUC__
+
+    arg_scanner<Source> scanner{ in, loc, &va };
+    int assigned = 0;
+
+    for (auto& tok : format)
+    {
+        auto r = tok.is_spec ? scanner.get(tok.spec) : scanner.match(tok.text);
+
+        if (r == scan_result::input_failure)
+            return assigned ? assigned : EOF;
+        if (r == scan_result::matching_failure)
+            break;
+
+        if (tok.is_spec)
+            assigned += scanner.assigns();
+    }
+
+    return assigned;
+}
+
+// calls 'f' with the cached compiled form of 'format', or with a local one on a nested miss
+template<class F>
+int with_compiled(red::string_view format, F&& f)
+{
+    using red::polyloc::fmt_kind;
+
+    red::polyloc::basic_fmt_lookup<char> cached{ format, fmt_kind::scan };
+    if (auto* cf = cached.get())
+        return f(*cf);
+
+    compiled_fmt local{ format, fmt_kind::scan };
+    return f(local);
+}
+
+} // unnamed
+
+
+int red::polyloc::do_scanf(string_view format, const char* str, const poly_locale& loc, va_list args, size_t* consumed)
+{
+    return with_compiled(format, [&](const compiled_fmt& cf) {
+        return do_scanf(cf, str, loc, args, consumed);
+    });
+}
+
+int red::polyloc::do_scanf(string_view format, FILE* file, const poly_locale& loc, va_list args, size_t* consumed)
+{
+    return with_compiled(format, [&](const compiled_fmt& cf) {
+        return do_scanf(cf, file, loc, args, consumed);
+    });
+}
+
+int red::polyloc::do_scanf(const compiled_fmt& format, const char* str, const poly_locale& loc, va_list args, size_t* consumed)
+{
+    string_source in{ str };
+    auto result = scan_impl(format, in, loc, args);
+    if (consumed)
+        *consumed = in.consumed();
+    return result;
+}
+
+int red::polyloc::do_scanf(const compiled_fmt& format, FILE* file, const poly_locale& loc, va_list args, size_t* consumed)
+{
+    file_source in{ file };
+    auto result = scan_impl(format, in, loc, args);
+    if (consumed)
+        *consumed = in.consumed();
+    return result;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstddef>
+#include <cstdio>
+
+#include "polyimpl.h"
+
+struct poly_locale;
+
+
+namespace red { namespace polyloc {
+
+template<class CharT> class basic_compiled_fmt;
+using compiled_fmt = basic_compiled_fmt<char>;
+
+// Reads 'str' according to the scanf format, storing into the pointers in 'va'.
+// Numbers are parsed like the strto* functions in 'loc', leading space is 'loc's space.
+// Returns the num. of assigned conversions, or EOF if the input ended before any assignment.
+// 'consumed' (optional) gets the num. of chars read.
+int do_scanf(string_view format, const char* str, const poly_locale& loc, va_list va, size_t* consumed = nullptr);
+
+// Same as above, reading from a FILE. Only the char that ended the last field is put back.
+int do_scanf(string_view format, FILE* file, const poly_locale& loc, va_list va, size_t* consumed = nullptr);
+
+// Same as above, for a format compiled w/ fmt_kind::scan. The string_view overloads
+// look the format up in the format cache and end up here.
+int do_scanf(const compiled_fmt& format, const char* str, const poly_locale& loc, va_list va, size_t* consumed = nullptr);
+
+int do_scanf(const compiled_fmt& format, FILE* file, const poly_locale& loc, va_list va, size_t* consumed = nullptr);
+
+}} // red::polyloc
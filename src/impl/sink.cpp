@@ -0,0 +1,348 @@
+#include "sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <new>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+namespace
+{
+
+#if defined(_WIN32)
+struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+};
+#endif
+
+// writes all of 'iov', going on after partial writes and EINTR
+bool write_all(int fd, iovec* iov, int n) noexcept
+{
+    while (n > 0)
+    {
+#if defined(_WIN32)
+        auto written = _write(fd, iov->iov_base, (unsigned)iov->iov_len);
+#else
+        auto written = ::writev(fd, iov, n);
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        auto left = size_t(written);
+        while (n > 0 && left >= iov->iov_len)
+        {
+            left -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    return true;
+}
+
+bool write_all(int fd, const char* data, size_t size) noexcept
+{
+    iovec iov{ const_cast<char*>(data), size };
+    return write_all(fd, &iov, 1);
+}
+
+// most set_fd_batch allocates up front, larger batches grow as they're used
+constexpr size_t FD_BATCH_RESERVE = 64 * 1024;
+
+// the calling thread's queued fd_sink output, all for the same fd.
+// What's still queued when the thread exits is dropped, the fd may be closed or reused by then.
+struct fd_batch
+{
+    int fd = -1;
+    size_t threshold = 0;
+    std::string pending;
+    bool failed = false; // a write nobody was told about yet
+
+    bool write_pending() noexcept
+    {
+        bool ok = pending.empty() || write_all(fd, pending.data(), pending.size());
+        pending.clear();
+        failed |= !ok;
+        return ok;
+    }
+
+    // queues 'data', or writes it w/ the queue when over the threshold
+    bool send(int to, const char* data, size_t size) noexcept
+    {
+        if (to != fd)
+        {
+            write_pending();
+            fd = to;
+        }
+
+        // no 'pending.size() + size', it wraps w/ a huge threshold
+        if (size <= threshold - pending.size())
+        {
+            try {
+                pending.append(data, size);
+                return true;
+            }
+            catch (const std::bad_alloc&) {
+                // out of memory, write it now
+            }
+        }
+
+        iovec iov[2] = {
+            { pending.data(), pending.size() },
+            { const_cast<char*>(data), size },
+        };
+        bool ok = write_all(fd, iov, 2);
+        pending.clear();
+        return ok;
+    }
+};
+
+thread_local fd_batch tl_fd_batch;
+
+} // unnamed
+
+
+
+namespace red::polyloc
+{
+
+template<class CharT>
+void basic_sink<CharT>::write_slow(const CharT* str, size_t n)
+{
+    while (n > 0)
+    {
+        if (m_pos == m_end && !overflow(n)) {
+            m_count += n;
+            return;
+        }
+
+        auto chunk = std::min(n, size_t(m_end - m_pos));
+        traits_type::copy(m_pos, str, chunk);
+        m_pos += chunk;
+        str += chunk;
+        n -= chunk;
+    }
+}
+
+template<class CharT>
+void basic_sink<CharT>::widen_slow(const char* str, size_t n)
+{
+    while (n > 0)
+    {
+        if (m_pos == m_end && !overflow(n)) {
+            m_count += n;
+            return;
+        }
+
+        auto chunk = std::min(n, size_t(m_end - m_pos));
+        for (size_t i = 0; i < chunk; i++)
+            m_pos[i] = CharT((unsigned char)str[i]);
+
+        m_pos += chunk;
+        str += chunk;
+        n -= chunk;
+    }
+}
+
+template<class CharT>
+void basic_sink<CharT>::fill(CharT ch, size_t n)
+{
+    while (n > 0)
+    {
+        if (m_pos == m_end && !overflow(n)) {
+            m_count += n;
+            return;
+        }
+
+        auto chunk = std::min(n, size_t(m_end - m_pos));
+        traits_type::assign(m_pos, chunk, ch);
+        m_pos += chunk;
+        n -= chunk;
+    }
+}
+
+template class basic_sink<char>;
+template class basic_sink<wchar_t>;
+
+
+bool buffer_sink::overflow(size_t hint)
+{
+    if (m_failed)
+        return false;
+
+    auto const used = length();
+    auto const capacity = std::max({ size_t(m_end - m_begin) * 2, used + hint, size_t(256) });
+
+    // + 1 for the null
+    auto grown = static_cast<char*>(m_heap ? std::realloc(m_heap, capacity + 1) : std::malloc(capacity + 1));
+    if (!grown) {
+        m_failed = true;
+        return false;
+    }
+
+    if (!m_heap && used)
+        std::memcpy(grown, m_begin, used);
+
+    m_heap = m_begin = grown;
+    m_pos = grown + used;
+    m_end = grown + capacity;
+    return true;
+}
+
+char* buffer_sink::release() noexcept
+{
+    if (m_failed)
+        return nullptr;
+
+    auto const used = length();
+    char* result;
+
+    if (m_heap)
+    {
+        // give back what the last growth step didn't use
+        result = static_cast<char*>(std::realloc(m_heap, used + 1));
+        if (!result)
+            result = m_heap;
+        m_heap = nullptr;
+    }
+    else
+    {
+        result = static_cast<char*>(std::malloc(used + 1));
+        if (!result)
+            return nullptr;
+        if (used)
+            std::memcpy(result, m_begin, used);
+    }
+
+    result[used] = '\0';
+
+    // back to the caller's storage
+    m_begin = m_pos = m_storage;
+    m_end = m_storage_end;
+    return result;
+}
+
+
+file_sink::file_sink(FILE* file) noexcept : sink(m_buf, m_buf + sizeof m_buf), m_file(file)
+{
+#if defined(_MSC_VER)
+    _lock_file(m_file);
+#else
+    flockfile(m_file);
+#endif
+}
+
+file_sink::~file_sink()
+{
+    flush();
+
+#if defined(_MSC_VER)
+    _unlock_file(m_file);
+#else
+    funlockfile(m_file);
+#endif
+}
+
+bool file_sink::flush() noexcept
+{
+    auto n = size_t(m_pos - m_begin);
+    if (n > 0 && !m_failed)
+    {
+        // the lock is ours already
+#if defined(_MSC_VER)
+        m_failed = _fwrite_nolock(m_begin, 1, n, m_file) != n;
+#elif defined(__GLIBC__)
+        m_failed = fwrite_unlocked(m_begin, 1, n, m_file) != n;
+#else
+        for (size_t i = 0; i < n && !m_failed; i++)
+            m_failed = putc_unlocked(m_begin[i], m_file) == EOF;
+#endif
+    }
+
+    m_count += n;
+    m_pos = m_begin;
+    return !m_failed;
+}
+
+
+bool fd_sink::flush() noexcept
+{
+    auto n = size_t(m_pos - m_begin);
+    if (n > 0 && !m_failed)
+    {
+        auto& batch = tl_fd_batch;
+        m_failed = batch.threshold ? !batch.send(m_fd, m_begin, n) : !write_all(m_fd, m_begin, n);
+    }
+
+    m_count += n;
+    m_pos = m_begin;
+    return !m_failed;
+}
+
+size_t set_fd_batch(size_t threshold) noexcept
+{
+    auto& batch = tl_fd_batch;
+    auto const old = batch.threshold;
+
+    if (threshold == 0)
+        batch.write_pending();
+
+    batch.threshold = threshold;
+    try {
+        // a huge threshold means "never write on my own", not "allocate all of it"
+        batch.pending.reserve(std::min(threshold, FD_BATCH_RESERVE));
+    }
+    catch (const std::bad_alloc&) {
+        // grows as it's used instead
+    }
+
+    return old;
+}
+
+bool flush_fd_batch() noexcept
+{
+    auto& batch = tl_fd_batch;
+    batch.write_pending();
+    return !std::exchange(batch.failed, false);
+}
+
+
+void ostream_sink::flush()
+{
+    auto n = m_pos - m_begin;
+    if (n > 0)
+    {
+        m_os.write(m_begin, n);
+        m_count += n;
+        m_pos = m_begin;
+    }
+}
+
+bool ostream_sink::overflow(size_t)
+{
+    flush();
+    return m_os.good();
+}
+
+} // red::polyloc
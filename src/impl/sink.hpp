@@ -0,0 +1,256 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iosfwd>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+
+#include "polyimpl.h"
+
+namespace red::polyloc
+{
+    // Output target of the formatting engine, 'CharT' is char or wchar_t.
+    // Chars are stored in the window [m_begin, m_end). Once it is full overflow() is called
+    // to make room, by flushing the window elsewhere or by growing it.
+    template<class CharT>
+    class basic_sink
+    {
+    public:
+        using char_type = CharT;
+        using traits_type = std::char_traits<CharT>;
+
+        basic_sink(basic_sink const&) = delete;
+        basic_sink& operator= (basic_sink const&) = delete;
+
+        void put(CharT ch)
+        {
+            if (m_pos == m_end && !overflow(1)) {
+                m_count++;
+                return;
+            }
+            *m_pos++ = ch;
+        }
+
+        void write(const CharT* str, size_t n)
+        {
+            if (size_t(m_end - m_pos) >= n) {
+                traits_type::copy(m_pos, str, n);
+                m_pos += n;
+            }
+            else {
+                write_slow(str, n);
+            }
+        }
+
+        void write(basic_string_view<CharT> str) { write(str.data(), str.size()); }
+
+        // Writes the ASCII chars of 'str', widened for a wide sink.
+        // Digits and signs are formatted as char, this is how they get into any sink.
+        void widen(string_view str)
+        {
+            if constexpr (std::is_same_v<CharT, char>)
+                write(str);
+            else
+                widen_slow(str.data(), str.size());
+        }
+
+        void fill(CharT ch, size_t n);
+
+        // num. of chars sent to the sink, including the ones a bounded sink had to drop
+        size_t size() const noexcept { return m_count + size_t(m_pos - m_begin); }
+
+    protected:
+        basic_sink() = default;
+        basic_sink(CharT* first, CharT* last) noexcept : m_begin(first), m_pos(first), m_end(last) {}
+        ~basic_sink() = default;
+
+        // Makes room for at least 1 char, 'hint' is how many are waiting to be written.
+        // Returns false when nothing else can be stored, pending chars are then counted and dropped.
+        virtual bool overflow(size_t hint) = 0;
+
+        CharT* m_begin = nullptr;
+        CharT* m_pos = nullptr;
+        CharT* m_end = nullptr;
+        size_t m_count = 0; // chars that already left the window
+
+    private:
+        void write_slow(const CharT* str, size_t n);
+        void widen_slow(const char* str, size_t n);
+    };
+
+    using sink = basic_sink<char>;
+    using wsink = basic_sink<wchar_t>;
+
+    extern template class basic_sink<char>;
+    extern template class basic_sink<wchar_t>;
+
+
+    // Writes at most count-1 chars into a caller buffer and counts the rest,
+    // snprintf style. finish() writes the terminating null.
+    template<class CharT>
+    class basic_bounded_sink final : public basic_sink<CharT>
+    {
+    public:
+        basic_bounded_sink(CharT* buffer, size_t count) noexcept
+            : basic_sink<CharT>(buffer, count ? buffer + count - 1 : buffer), m_count0(count)
+        {}
+
+        void finish() noexcept
+        {
+            if (m_count0 > 0)
+                *this->m_pos = CharT();
+        }
+
+    private:
+        bool overflow(size_t) override { return false; }
+
+        size_t m_count0;
+    };
+
+    using bounded_sink = basic_bounded_sink<char>;
+    using wbounded_sink = basic_bounded_sink<wchar_t>;
+
+
+    // Writes into a caller buffer assumed to be large enough, sprintf style.
+    // finish() writes the terminating null.
+    class pointer_sink final : public sink
+    {
+    public:
+        explicit pointer_sink(char* buffer) noexcept : sink(buffer, buffer + STEP) {}
+
+        void finish() noexcept { *m_pos = '\0'; }
+
+    private:
+        static constexpr size_t STEP = 4096;
+
+        // the caller vouched for the space, just move the end forward
+        bool overflow(size_t hint) override
+        {
+            m_end = m_pos + (hint > STEP ? hint : STEP);
+            return true;
+        }
+    };
+
+
+    // Appends to caller storage, then to a malloc'ed buffer grown geometrically once that's
+    // full. Keeps its capacity when cleared, so a reused sink stops allocating.
+    // There's always room for a null past the chars.
+    class buffer_sink final : public sink
+    {
+    public:
+        // w/o 'storage' or w/ a 0 'capacity' (no room for the null) the sink starts on the heap
+        buffer_sink(char* storage, size_t capacity) noexcept
+            : sink(capacity ? storage : nullptr, storage && capacity ? storage + capacity - 1 : nullptr),
+              m_storage(m_begin), m_storage_end(m_end)
+        {}
+        ~buffer_sink() { std::free(m_heap); }
+
+        // the null terminated contents
+        const char* data() noexcept
+        {
+            if (!m_begin)
+                return "";
+            *m_pos = '\0';
+            return m_begin;
+        }
+
+        size_t length() const noexcept { return size_t(m_pos - m_begin); }
+
+        // true if growing has failed, the chars that didn't fit were dropped
+        bool failed() const noexcept { return m_failed; }
+
+        // drops the chars past 'len'
+        void truncate(size_t len) noexcept
+        {
+            if (len < length())
+                m_pos = m_begin + len;
+            m_count = 0;
+            m_failed = false;
+        }
+
+        void clear() noexcept { truncate(0); }
+
+        // the null terminated contents at their exact size, for free(). Leaves the sink empty.
+        // nullptr when out of memory.
+        char* release() noexcept;
+
+    private:
+        bool overflow(size_t hint) override;
+
+        char* m_storage;
+        char* m_storage_end;
+        char* m_heap = nullptr;
+        bool m_failed = false;
+    };
+
+
+    // Writes to a C FILE in chunks, going through the FILE's own buffering.
+    // Holds the FILE's lock from construction to destruction, so a call takes it once
+    // and the output of concurrent calls doesn't interleave.
+    class file_sink final : public sink
+    {
+    public:
+        explicit file_sink(FILE* file) noexcept;
+        ~file_sink();
+
+        // sends pending chars to the FILE, returns false if it has failed
+        bool flush() noexcept;
+        bool failed() const noexcept { return m_failed; }
+
+    private:
+        bool overflow(size_t) override { return flush(); }
+
+        FILE* m_file;
+        bool m_failed = false;
+        char m_buf[512];
+    };
+
+
+    // Writes to a file descriptor. Output is staged in the sink's own buffer, so a call
+    // that fits it makes a single write().
+    // While the calling thread batches (see set_fd_batch) the output is queued instead,
+    // and goes out w/ the rest of the batch in one writev().
+    class fd_sink final : public sink
+    {
+    public:
+        explicit fd_sink(int fd) noexcept : sink(m_buf, m_buf + sizeof m_buf), m_fd(fd) {}
+        ~fd_sink() { flush(); }
+
+        // sends or queues pending chars, returns false if a write has failed
+        bool flush() noexcept;
+
+    private:
+        bool overflow(size_t) override { return flush(); }
+
+        int m_fd;
+        bool m_failed = false;
+        char m_buf[1024];
+    };
+
+    // Makes the calling thread's fd_sinks queue up to 'threshold' bytes before writing,
+    // 0 writes what's queued and turns batching off. Returns the previous threshold.
+    size_t set_fd_batch(size_t threshold) noexcept;
+    // Writes the calling thread's queued output. Returns false if that or an earlier
+    // batched write has failed.
+    bool flush_fd_batch() noexcept;
+
+
+    // Adapter for std::ostream, chars are passed in chunks to its streambuf.
+    class ostream_sink final : public sink
+    {
+    public:
+        explicit ostream_sink(std::ostream& os) noexcept : sink(m_buf, m_buf + sizeof m_buf), m_os(os) {}
+        ~ostream_sink() { flush(); }
+
+        void flush();
+
+    private:
+        bool overflow(size_t) override;
+
+        std::ostream& m_os;
+        char m_buf[256];
+    };
+}
@@ -0,0 +1,214 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+std::atomic<bool> red::polyloc::g_stats_enabled{ false };
+
+namespace
+{
+
+using red::polyloc::stat_counter;
+
+constexpr size_t NUM_COUNTERS = size_t(stat_counter::count_);
+
+// A thread's counters. Only the owner writes them, other threads read them when summing,
+// so relaxed load + store is enough; no locked instructions on the hot path.
+struct thread_stats
+{
+    struct fn_stats
+    {
+        std::atomic<std::uint64_t> calls{ 0 }, bytes{ 0 };
+        std::atomic<std::uint64_t> latency[POLYLOC_STAT_BUCKETS] = {};
+    };
+
+    fn_stats fn[POLYLOC_STAT_FN_COUNT];
+    std::atomic<std::uint64_t> counters[NUM_COUNTERS] = {};
+};
+
+void bump(std::atomic<std::uint64_t>& c, std::uint64_t n = 1) noexcept
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// 0 for 0ns, then 1 + floor(log2(ns)), the last bucket takes the rest
+unsigned latency_bucket(std::uint64_t ns) noexcept
+{
+    unsigned b = 0;
+    for (; ns && b < POLYLOC_STAT_BUCKETS - 1; ns >>= 1)
+        b++;
+    return b;
+}
+
+unsigned long long& counter_of(polyloc_stats& s, stat_counter c) noexcept
+{
+    switch (c)
+    {
+    case stat_counter::fmt_cache_hit: return s.fmt_cache_hits;
+    case stat_counter::fmt_cache_miss: return s.fmt_cache_misses;
+    case stat_counter::registry_hit: return s.registry_hits;
+    default: return s.registry_misses;
+    }
+}
+
+void add(polyloc_stats& to, thread_stats const& from) noexcept
+{
+    for (size_t f = 0; f < POLYLOC_STAT_FN_COUNT; f++)
+    {
+        to.fn[f].calls += from.fn[f].calls.load(std::memory_order_relaxed);
+        to.fn[f].bytes += from.fn[f].bytes.load(std::memory_order_relaxed);
+        for (size_t b = 0; b < POLYLOC_STAT_BUCKETS; b++)
+            to.fn[f].latency[b] += from.fn[f].latency[b].load(std::memory_order_relaxed);
+    }
+
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+        counter_of(to, stat_counter(c)) += from.counters[c].load(std::memory_order_relaxed);
+}
+
+void subtract(polyloc_stats& from, polyloc_stats const& base) noexcept
+{
+    for (size_t f = 0; f < POLYLOC_STAT_FN_COUNT; f++)
+    {
+        from.fn[f].calls -= base.fn[f].calls;
+        from.fn[f].bytes -= base.fn[f].bytes;
+        for (size_t b = 0; b < POLYLOC_STAT_BUCKETS; b++)
+            from.fn[f].latency[b] -= base.fn[f].latency[b];
+    }
+
+    from.fmt_cache_hits -= base.fmt_cache_hits;
+    from.fmt_cache_misses -= base.fmt_cache_misses;
+    from.registry_hits -= base.registry_hits;
+    from.registry_misses -= base.registry_misses;
+}
+
+// Every thread that recorded something. Counters only grow: exited threads are folded
+// into 'retired' and a reset remembers the totals as 'baseline', so nobody writes
+// another thread's counters.
+struct stats_registry
+{
+    std::mutex mutex;
+    std::vector<thread_stats*> live;
+    polyloc_stats retired{};
+    polyloc_stats baseline{};
+
+    // all counts, ignoring the baseline. Call locked.
+    polyloc_stats total() const noexcept
+    {
+        auto result = retired;
+        for (auto ts : live)
+            add(result, *ts);
+        return result;
+    }
+};
+
+// never destroyed, threads may exit after static destructors ran
+stats_registry& registry()
+{
+    static auto instance = new stats_registry;
+    return *instance;
+}
+
+// the hot path only touches these trivial thread_locals, no TLS init guard
+thread_local thread_stats* tl_stats = nullptr;
+thread_local unsigned tl_calls = 0;
+
+// hands the counters back when the thread exits
+struct thread_slot
+{
+    thread_stats* stats = nullptr;
+
+    ~thread_slot()
+    {
+        if (!stats)
+            return;
+
+        tl_stats = nullptr;
+        auto& reg = registry();
+        std::lock_guard lock{ reg.mutex };
+        add(reg.retired, *stats);
+        reg.live.erase(std::find(reg.live.begin(), reg.live.end(), stats));
+        delete stats;
+    }
+};
+
+thread_local thread_slot tl_slot;
+
+thread_stats& local_stats()
+{
+    if (!tl_stats)
+    {
+        auto ts = std::make_unique<thread_stats>();
+        auto& reg = registry();
+        std::lock_guard lock{ reg.mutex };
+        reg.live.push_back(ts.get());
+        tl_slot.stats = tl_stats = ts.release();
+    }
+
+    return *tl_stats;
+}
+
+} // unnamed
+
+
+void red::polyloc::record_call(polyloc_stat_fn fn, std::uint64_t bytes, std::int64_t ns) noexcept
+{
+    try
+    {
+        auto& s = local_stats().fn[fn];
+        bump(s.calls);
+        bump(s.bytes, bytes);
+        if (ns >= 0)
+            bump(s.latency[latency_bucket(ns)]);
+    }
+    catch (const std::exception&)
+    {
+        // no memory for this thread's counters, the call goes uncounted
+    }
+}
+
+void red::polyloc::record(stat_counter c) noexcept
+{
+    try
+    {
+        bump(local_stats().counters[size_t(c)]);
+    }
+    catch (const std::exception&)
+    {
+    }
+}
+
+bool red::polyloc::sample_latency() noexcept
+{
+    return (tl_calls++ & (POLYLOC_STAT_LATENCY_SAMPLE - 1)) == 0;
+}
+
+
+extern "C" {
+
+int polyloc_stats_enable(int enable)
+{
+    return red::polyloc::g_stats_enabled.exchange(enable != 0);
+}
+
+void polyloc_stats_get(polyloc_stats* out)
+{
+    if (!out)
+        return;
+
+    auto& reg = registry();
+    std::lock_guard lock{ reg.mutex };
+    *out = reg.total();
+    subtract(*out, reg.baseline);
+}
+
+void polyloc_stats_reset(void)
+{
+    auto& reg = registry();
+    std::lock_guard lock{ reg.mutex };
+    reg.baseline = reg.total();
+}
+
+} // extern "C"
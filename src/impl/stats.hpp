@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "../polylocale.h"
+
+namespace red::polyloc
+{
+    enum class stat_counter : unsigned char
+    {
+        fmt_cache_hit, fmt_cache_miss,
+        registry_hit, registry_miss,
+
+        count_
+    };
+
+    extern std::atomic<bool> g_stats_enabled;
+
+    inline bool stats_enabled() noexcept {
+        return g_stats_enabled.load(std::memory_order_relaxed);
+    }
+
+    // add to the calling thread's counters, only call when stats_enabled().
+    // 'ns' < 0 means the call wasn't timed.
+    void record_call(polyloc_stat_fn fn, std::uint64_t bytes, std::int64_t ns) noexcept;
+    void record(stat_counter c) noexcept;
+    // true for 1 in POLYLOC_STAT_LATENCY_SAMPLE calls of this thread
+    bool sample_latency() noexcept;
+
+    inline void count(stat_counter c) noexcept
+    {
+        if (stats_enabled())
+            record(c);
+    }
+
+    // Counts an entry point call from construction to done(), timing a sample of them.
+    // A load and a branch when stats are off.
+    class timed_call
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        // 'always_time' for the rare, slow paths a sample would miss
+        explicit timed_call(polyloc_stat_fn fn, bool always_time = false) noexcept
+            : m_fn(fn), m_on(stats_enabled())
+        {
+            m_timed = m_on && (always_time || sample_latency());
+            if (m_timed)
+                m_start = clock::now();
+        }
+
+        // 'bytes' < 0 (an error result) counts as 0
+        void done(long long bytes) noexcept
+        {
+            if (!m_on)
+                return;
+
+            std::int64_t ns = -1;
+            if (m_timed)
+                ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - m_start).count();
+            record_call(m_fn, bytes > 0 ? bytes : 0, ns);
+        }
+
+    private:
+        polyloc_stat_fn m_fn;
+        bool m_on, m_timed;
+        clock::time_point m_start;
+    };
+}
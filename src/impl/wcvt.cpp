@@ -0,0 +1,455 @@
+#include "wcvt.hpp"
+#include "sink.hpp"
+#include "locale.hpp"
+#include "numfmt.hpp"
+#include "bitmask.hpp"
+
+#include <cstdint>
+#include <cwchar>
+#include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <string>
+
+
+using red::polyloc::fmt_flags;
+using red::wstring_view;
+using red::string_view;
+namespace bm = bitmask;
+
+namespace
+{
+
+constexpr char32_t REPLACEMENT_CHAR = 0xFFFD;
+constexpr size_t ASCII_BLOCK = 8;
+
+// true if the next ASCII_BLOCK wchar_t are all ASCII, written so it vectorizes
+bool all_ascii(const wchar_t* p) noexcept
+{
+    std::uint32_t acc = 0;
+    for (size_t i = 0; i < ASCII_BLOCK; i++)
+        acc |= std::uint32_t(p[i]);
+
+    return acc < 0x80;
+}
+
+// Decodes the code point at 'p' (UTF-32, or UTF-16 w/ a 2 byte wchar_t) and advances it.
+// Lone surrogates and values out of range come back as U+FFFD.
+char32_t next_code_point(const wchar_t*& p, const wchar_t* last) noexcept
+{
+    auto c = char32_t(std::uint32_t(*p++));
+
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        if (c >= 0xD800 && c < 0xDC00 && p != last)
+        {
+            auto low = char32_t(std::uint32_t(*p));
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                p++;
+                return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+            }
+        }
+    }
+
+    if ((c >= 0xD800 && c < 0xE000) || c > 0x10FFFF)
+        return REPLACEMENT_CHAR;
+
+    return c;
+}
+
+size_t utf8_size(char32_t c) noexcept
+{
+    return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+char* encode_utf8(char32_t c, char* d) noexcept
+{
+    if (c < 0x80)
+    {
+        *d++ = char(c);
+    }
+    else if (c < 0x800)
+    {
+        *d++ = char(0xC0 | (c >> 6));
+        *d++ = char(0x80 | (c & 0x3F));
+    }
+    else if (c < 0x10000)
+    {
+        *d++ = char(0xE0 | (c >> 12));
+        *d++ = char(0x80 | ((c >> 6) & 0x3F));
+        *d++ = char(0x80 | (c & 0x3F));
+    }
+    else
+    {
+        *d++ = char(0xF0 | (c >> 18));
+        *d++ = char(0x80 | ((c >> 12) & 0x3F));
+        *d++ = char(0x80 | ((c >> 6) & 0x3F));
+        *d++ = char(0x80 | (c & 0x3F));
+    }
+
+    return d;
+}
+
+// How much of [p, last) fits in 'max_bytes' of UTF-8, only counting whole chars.
+// Returns where that ends, 'bytes' gets its size.
+const wchar_t* utf8_extent(const wchar_t* p, const wchar_t* last, size_t max_bytes, size_t& bytes) noexcept
+{
+    bytes = 0;
+
+    while (p != last)
+    {
+        if (size_t(last - p) >= ASCII_BLOCK && max_bytes - bytes >= ASCII_BLOCK && all_ascii(p))
+        {
+            p += ASCII_BLOCK;
+            bytes += ASCII_BLOCK;
+            continue;
+        }
+
+        auto next = p;
+        auto n = utf8_size(next_code_point(next, last));
+        if (n > max_bytes - bytes)
+            break;
+
+        bytes += n;
+        p = next;
+    }
+
+    return p;
+}
+
+// UTF-8 of [p, last) into 'out', staged in a small buffer
+void write_utf8(red::polyloc::sink& out, const wchar_t* p, const wchar_t* last)
+{
+    char buf[256];
+    char* w = buf;
+
+    while (p != last)
+    {
+        // room for an ASCII block or the longest sequence
+        if (w > buf + sizeof buf - ASCII_BLOCK)
+        {
+            out.write(buf, size_t(w - buf));
+            w = buf;
+        }
+
+        if (size_t(last - p) >= ASCII_BLOCK && all_ascii(p))
+        {
+            for (size_t i = 0; i < ASCII_BLOCK; i++)
+                w[i] = char(p[i]);
+
+            w += ASCII_BLOCK;
+            p += ASCII_BLOCK;
+            continue;
+        }
+
+        w = encode_utf8(next_code_point(p, last), w);
+    }
+
+    out.write(buf, size_t(w - buf));
+}
+
+// 'str' through the locale's codecvt, a char at a time so a precision never splits one.
+// Chars it can't convert are written as '?'.
+std::string convert_codecvt(red::wstring_view str, size_t max_bytes, poly_locale const& lc)
+{
+    using cvt = std::codecvt<wchar_t, char, std::mbstate_t>;
+    auto& cv = lc.wcvt;
+
+    std::string result;
+    std::mbstate_t state{};
+    char buf[16];
+
+    for (auto ch = str.data(), last = ch + str.size(); ch != last; ++ch)
+    {
+        const wchar_t* from_next;
+        char* to_next;
+        auto saved = state;
+
+        auto r = cv.out(state, ch, ch + 1, from_next, buf, buf + sizeof buf, to_next);
+        if (r == cvt::noconv)
+        {
+            buf[0] = char(*ch);
+            to_next = buf + 1;
+        }
+        else if (r != cvt::ok)
+        {
+            state = saved;
+            buf[0] = '?';
+            to_next = buf + 1;
+        }
+
+        auto n = size_t(to_next - buf);
+        if (n > max_bytes - result.size())
+            break;
+
+        result.append(buf, n);
+    }
+
+    return result;
+}
+
+// Decodes the UTF-8 sequence at 'p' and advances it. Invalid, overlong or truncated
+// sequences come back as U+FFFD, consuming one byte.
+char32_t next_utf8(const char*& p, const char* last) noexcept
+{
+    auto const lead = (unsigned char)*p++;
+    if (lead < 0x80)
+        return lead;
+
+    size_t n;
+    char32_t c, min;
+    if (lead >= 0xC2 && lead < 0xE0) { n = 1; c = lead & 0x1F; min = 0x80; }
+    else if (lead >= 0xE0 && lead < 0xF0) { n = 2; c = lead & 0x0F; min = 0x800; }
+    else if (lead >= 0xF0 && lead < 0xF5) { n = 3; c = lead & 0x07; min = 0x10000; }
+    else return REPLACEMENT_CHAR;
+
+    if (size_t(last - p) < n)
+        return REPLACEMENT_CHAR;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        auto const cont = (unsigned char)p[i];
+        if ((cont & 0xC0) != 0x80)
+            return REPLACEMENT_CHAR;
+        c = (c << 6) | (cont & 0x3F);
+    }
+
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000))
+        return REPLACEMENT_CHAR;
+
+    p += n;
+    return c;
+}
+
+// true if the next 8 bytes are all ASCII
+bool all_ascii(const char* p) noexcept
+{
+    std::uint64_t word;
+    std::memcpy(&word, p, 8);
+    return (word & 0x8080808080808080) == 0;
+}
+
+// num. of wchar_t taken by 'c', 2 for a surrogate pair w/ a 2 byte wchar_t
+size_t wide_size(char32_t c) noexcept
+{
+    return sizeof(wchar_t) == 2 && c > 0xFFFF ? 2 : 1;
+}
+
+wchar_t* encode_wide(char32_t c, wchar_t* d) noexcept
+{
+    if (wide_size(c) == 2)
+    {
+        c -= 0x10000;
+        *d++ = wchar_t(0xD800 + (c >> 10));
+        *d++ = wchar_t(0xDC00 + (c & 0x3FF));
+    }
+    else
+    {
+        *d++ = wchar_t(c);
+    }
+
+    return d;
+}
+
+// How much of UTF-8 [p, last) fits in 'max_chars' wide chars, only counting whole code points.
+// Returns where that ends, 'count' gets the num. of wide chars.
+const char* wide_extent(const char* p, const char* last, size_t max_chars, size_t& count) noexcept
+{
+    count = 0;
+
+    while (p != last)
+    {
+        if (size_t(last - p) >= ASCII_BLOCK && max_chars - count >= ASCII_BLOCK && all_ascii(p))
+        {
+            p += ASCII_BLOCK;
+            count += ASCII_BLOCK;
+            continue;
+        }
+
+        auto next = p;
+        auto n = wide_size(next_utf8(next, last));
+        if (n > max_chars - count)
+            break;
+
+        count += n;
+        p = next;
+    }
+
+    return p;
+}
+
+// wide chars of UTF-8 [p, last) into 'out', staged in a small buffer
+void write_wide(red::polyloc::wsink& out, const char* p, const char* last)
+{
+    wchar_t buf[128];
+    wchar_t* w = buf;
+
+    while (p != last)
+    {
+        if (w > buf + std::size(buf) - ASCII_BLOCK)
+        {
+            out.write(buf, size_t(w - buf));
+            w = buf;
+        }
+
+        if (size_t(last - p) >= ASCII_BLOCK && all_ascii(p))
+        {
+            for (size_t i = 0; i < ASCII_BLOCK; i++)
+                w[i] = wchar_t(p[i]);
+
+            w += ASCII_BLOCK;
+            p += ASCII_BLOCK;
+            continue;
+        }
+
+        w = encode_wide(next_utf8(p, last), w);
+    }
+
+    out.write(buf, size_t(w - buf));
+}
+
+// 'str' through the locale's codecvt, sequences it can't convert become U+FFFD
+std::wstring convert_codecvt(string_view str, size_t max_chars, poly_locale const& lc)
+{
+    using cvt = std::codecvt<wchar_t, char, std::mbstate_t>;
+    auto& cv = lc.wcvt;
+
+    std::wstring result;
+    std::mbstate_t state{};
+    wchar_t buf[64];
+    auto from = str.data();
+    auto const last = from + str.size();
+
+    while (from != last && result.size() < max_chars)
+    {
+        const char* from_next;
+        wchar_t* to_next;
+
+        auto r = cv.in(state, from, last, from_next, buf, buf + std::size(buf), to_next);
+        if (r == cvt::noconv)
+        {
+            for (; from != last && result.size() < max_chars; ++from)
+                result += wchar_t((unsigned char)*from);
+            break;
+        }
+
+        result.append(buf, std::min(size_t(to_next - buf), max_chars - result.size()));
+        from = from_next;
+
+        // partial w/ a full buffer just needs another round
+        if (r == cvt::error || (r == cvt::partial && to_next != buf + std::size(buf)))
+        {
+            if (from == last || result.size() == max_chars)
+                break;
+
+            // skip the offending byte
+            result += wchar_t(REPLACEMENT_CHAR);
+            state = {};
+            from++;
+        }
+    }
+
+    return result;
+}
+
+} // unnamed
+
+
+void red::polyloc::put_wstr(sink& out, wstring_view str, int width, int precision, fmt_flags flags, poly_locale const& lc)
+{
+    auto const max_bytes = precision >= 0 ? size_t(precision) : SIZE_MAX;
+
+    if (!lc.data.utf8)
+    {
+        auto bytes = convert_codecvt(str, max_bytes, lc);
+        put_padded(out, {}, bytes, width, flags);
+        return;
+    }
+
+    size_t bytes;
+    auto const first = str.data();
+    auto const last = utf8_extent(first, first + str.size(), max_bytes, bytes);
+    auto const pad = width > 0 && size_t(width) > bytes ? size_t(width) - bytes : 0;
+
+    // same padding as put_padded, '-' always pads w/ spaces
+    if (bm::has(flags, fmt_flags::left))
+    {
+        write_utf8(out, first, last);
+        out.fill(' ', pad);
+    }
+    else
+    {
+        out.fill(bm::has(flags, fmt_flags::zero) ? '0' : ' ', pad);
+        write_utf8(out, first, last);
+    }
+}
+
+void red::polyloc::put_mbstr(wsink& out, string_view str, int width, int precision, fmt_flags flags, poly_locale const& lc)
+{
+    auto const max_chars = precision >= 0 ? size_t(precision) : SIZE_MAX;
+
+    if (!lc.data.utf8)
+    {
+        auto chars = convert_codecvt(str, max_chars, lc);
+        put_padded(out, {}, chars, width, flags);
+        return;
+    }
+
+    size_t count;
+    auto const first = str.data();
+    auto const last = wide_extent(first, first + str.size(), max_chars, count);
+    auto const pad = width > 0 && size_t(width) > count ? size_t(width) - count : 0;
+
+    if (bm::has(flags, fmt_flags::left))
+    {
+        write_wide(out, first, last);
+        out.fill(L' ', pad);
+    }
+    else
+    {
+        out.fill(bm::has(flags, fmt_flags::zero) ? L'0' : L' ', pad);
+        write_wide(out, first, last);
+    }
+}
+
+size_t red::polyloc::wide_length(string_view str, poly_locale const& lc)
+{
+    if (!lc.data.utf8)
+        return convert_codecvt(str, SIZE_MAX, lc).size();
+
+    size_t count;
+    wide_extent(str.data(), str.data() + str.size(), SIZE_MAX, count);
+    return count;
+}
+
+
+void red::polyloc::encoding_sink::flush()
+{
+    send(size_t(m_pos - m_begin));
+}
+
+bool red::polyloc::encoding_sink::overflow(size_t)
+{
+    auto n = size_t(m_pos - m_begin);
+
+    // a high surrogate waits for its other half
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        if (n > 0 && m_begin[n - 1] >= 0xD800 && m_begin[n - 1] < 0xDC00)
+            n--;
+    }
+
+    send(n);
+    return true;
+}
+
+void red::polyloc::encoding_sink::send(size_t n)
+{
+    put_wstr(m_out, { m_begin, n }, 0, -1, fmt_flags::none, m_lc);
+
+    auto const kept = size_t(m_pos - m_begin) - n;
+    traits_type::move(m_begin, m_begin + n, kept);
+    m_count += n;
+    m_pos = m_begin + kept;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "polyimpl.h"
+#include "printf_fmt.hpp"
+#include "sink.hpp"
+
+struct poly_locale;
+
+namespace red::polyloc
+{
+    // %ls %S %lc %C
+    // Writes 'str' in the multibyte encoding of 'lc', padded to 'width' bytes. A 'precision'
+    // limits the num. of bytes written, only whole chars are written.
+    // UTF-8 locales are encoded directly, others go through the locale's codecvt.
+    void put_wstr(sink& out, wstring_view str, int width, int precision, fmt_flags flags, poly_locale const& lc);
+
+    // %s %c of the wide printf family
+    // Writes the multibyte 'str' of 'lc' as wide chars, padded to 'width' wide chars. A 'precision'
+    // limits the num. of wide chars written. Invalid sequences are written as U+FFFD.
+    void put_mbstr(wsink& out, string_view str, int width, int precision, fmt_flags flags, poly_locale const& lc);
+    // num. of wide chars put_mbstr writes for all of 'str', each U+FFFD included
+    size_t wide_length(string_view str, poly_locale const& lc);
+
+    // Wide sink that hands its chars to a narrow sink, in the multibyte encoding of 'lc'.
+    // Used by the wide printf family to write to a FILE.
+    class encoding_sink final : public wsink
+    {
+    public:
+        encoding_sink(sink& out, poly_locale const& lc) noexcept
+            : wsink(m_buf, m_buf + std::size(m_buf)), m_out(out), m_lc(lc)
+        {}
+        ~encoding_sink() { flush(); }
+
+        void flush();
+
+    private:
+        bool overflow(size_t) override;
+        // encodes the first 'n' chars of the window and drops them
+        void send(size_t n);
+
+        sink& m_out;
+        poly_locale const& m_lc;
+        wchar_t m_buf[256];
+    };
+}
@@ -0,0 +1,405 @@
+/*
+    polyformat: C++17 formatting w/ the format parsed and type checked at compile time
+
+        char buf[64];
+        auto end = red::polyloc::format_to(buf, loc, POLYLOC_FMT("%s: %.2f"), name, value);
+        std::string str = red::polyloc::format(loc, POLYLOC_FMT("%s: %.2f"), name, value);
+
+    Each conversion becomes a direct call to its formatter, no va_list and no parsing at run time.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "polylocale.h"
+#include "impl/polyimpl.h"
+#include "impl/printf_fmt.hpp"
+#include "impl/numfmt.hpp"
+#include "impl/sink.hpp"
+#include "impl/locale.hpp"
+#include "impl/wcvt.hpp"
+
+// A format string for red::polyloc::format_to, 'str' must be a string literal.
+#define POLYLOC_FMT(str) \
+    [] { \
+        struct polyloc_fmt_string : ::red::polyloc::compile_string { \
+            static constexpr ::red::string_view value() noexcept { return str; } \
+        }; \
+        return polyloc_fmt_string{}; \
+    }()
+
+namespace red::polyloc
+{
+    // base of the types made by POLYLOC_FMT
+    struct compile_string {};
+
+    template<class S>
+    inline constexpr bool is_compile_string_v = std::is_base_of_v<compile_string, S>;
+
+    namespace fmt_detail
+    {
+        template<class>
+        inline constexpr bool always_false = false;
+
+        // a literal run or a spec of the format, w/ the indexes of the arguments it takes
+        struct segment
+        {
+            size_t begin = 0, size = 0;
+            bool is_spec = false;
+            fmtspec_t spec;
+            int width_arg = -1, precision_arg = -1, value_arg = -1;
+        };
+
+        enum class plan_error { none, incomplete_spec, invalid_conversion, n_conversion, mixed_positions };
+
+        // 'error' is set instead of failing right away, so static_assert can tell what's wrong
+        template<size_t N>
+        struct plan
+        {
+            segment seg[N > 0 ? N : 1] = {};
+            size_t args = 0;
+            plan_error error = plan_error::none;
+        };
+
+        constexpr size_t count_segments(string_view fmt) noexcept
+        {
+            size_t n = 0;
+            auto p = fmt.data();
+            auto const last = p + fmt.size();
+            string_view tok;
+
+            while (p != last)
+            {
+                p = scan_fmt_token(p, last, tok);
+                if (tok.empty())
+                    break;
+                n++;
+            }
+            return n;
+        }
+
+        template<size_t N>
+        constexpr plan<N> make_plan(string_view fmt) noexcept
+        {
+            plan<N> result;
+            auto p = fmt.data();
+            auto const last = p + fmt.size();
+            int arg = 0, numbered = -1;
+
+            // the index of a "%n$" or '*m$' argument, or of the next one in order
+            auto const take = [&](int pos) {
+                if (numbered < 0)
+                    numbered = pos > 0;
+                if (numbered != (pos > 0)) {
+                    result.error = plan_error::mixed_positions;
+                    return 0;
+                }
+
+                if (!numbered)
+                    return arg++;
+                arg = pos > arg ? pos : arg;
+                return pos - 1;
+            };
+
+            for (size_t i = 0; i < N; i++)
+            {
+                string_view tok;
+                auto const start = p;
+                p = scan_fmt_token(p, last, tok);
+
+                auto& seg = result.seg[i];
+                seg.begin = size_t(tok.data() - fmt.data());
+                seg.size = tok.size();
+
+                // "%" from "%%" starts past 'start', a '%' w/ nothing valid after it doesn't
+                if (tok.size() == 1 && tok[0] == fmt_chars::FMT_START && tok.data() == start)
+                    result.error = plan_error::incomplete_spec;
+
+                if (tok.size() < 2 || tok[0] != fmt_chars::FMT_START)
+                    continue;
+
+                seg.is_spec = true;
+                seg.spec = parsefmt(tok);
+
+                if (seg.spec.conversion == '\030')
+                    result.error = plan_error::invalid_conversion;
+                else if (seg.spec.conversion == 'n')
+                    result.error = plan_error::n_conversion;
+
+                if (seg.spec.field_width == fmtspec_t::VAL_VA)
+                    seg.width_arg = take(seg.spec.width_pos);
+                if (seg.spec.precision == fmtspec_t::VAL_VA)
+                    seg.precision_arg = take(seg.spec.precision_pos);
+                seg.value_arg = take(seg.spec.arg_pos);
+            }
+
+            if (p != last)
+                result.error = plan_error::incomplete_spec; // a lone '%' at the end
+
+            result.args = size_t(arg);
+            return result;
+        }
+
+        template<class S>
+        inline constexpr auto plan_of = make_plan<count_segments(S::value())>(S::value());
+
+        // the value of a '*' width or precision
+        template<class T>
+        int star_arg(const T& value) noexcept
+        {
+            static_assert(std::is_integral_v<T>, "'*' takes an integer argument");
+            return int(value);
+        }
+
+        template<class T>
+        constexpr bool is_narrow_string_v = std::is_convertible_v<const T&, string_view>;
+        template<class T>
+        constexpr bool is_wide_string_v = std::is_convertible_v<const T&, wstring_view>;
+
+        inline void put_str(sink& out, string_view str, fmtspec_t const& spec, bool limited = true)
+        {
+            if (limited && spec.precision >= 0)
+                str = str.substr(0, spec.precision);
+
+            put_padded(out, {}, str, spec.field_width, spec.flagset);
+        }
+
+        // the argument of segment 'I' of 'S'
+        template<class S, size_t I, class T>
+        void put_arg(sink& out, poly_locale const& lc, fmtspec_t const& spec, const T& value)
+        {
+            constexpr auto conv = plan_of<S>.seg[I].spec.conversion;
+            constexpr auto len = plan_of<S>.seg[I].spec.length_mod;
+
+            if constexpr (conv == 'd' || conv == 'i' || conv == 'u' || conv == 'o' || conv == 'x' || conv == 'X')
+            {
+                static_assert(std::is_integral_v<T> || std::is_enum_v<T>, "integer conversion of a non integer argument");
+
+                // bool, char and enums, like printf would see them
+                auto const promoted = [&] {
+                    if constexpr (std::is_enum_v<T>)
+                        return +std::underlying_type_t<T>(value);
+                    else
+                        return +value;
+                }();
+
+                // hh and h still narrow, the rest of the sizes are the argument's own
+                using P = decltype(promoted);
+                using narrowed = std::conditional_t<len == "hh", signed char, std::conditional_t<len == "h", short, P>>;
+
+                if constexpr (conv == 'd' || conv == 'i')
+                {
+                    auto v = std::make_signed_t<narrowed>(promoted);
+                    auto mag = v < 0 ? 0 - std::uint64_t(v) : std::uint64_t(v);
+                    put_int(out, mag, v < 0, conv, spec.field_width, spec.precision, spec.flagset, lc.data);
+                }
+                else
+                {
+                    auto v = std::make_unsigned_t<narrowed>(promoted);
+                    put_int(out, std::uint64_t(v), false, conv, spec.field_width, spec.precision, spec.flagset, lc.data);
+                }
+            }
+            else if constexpr (conv == 'e' || conv == 'E' || conv == 'f' || conv == 'F' || conv == 'g' || conv == 'G' || conv == 'a' || conv == 'A')
+            {
+                static_assert(std::is_floating_point_v<T>, "floating point conversion of a non floating point argument");
+                put_fp(out, double(value), conv, spec.field_width, spec.precision, spec.flagset, lc.data);
+            }
+            else if constexpr (conv == 'c' || conv == 'C')
+            {
+                static_assert(std::is_integral_v<T>, "%c takes a char argument");
+
+                if constexpr (conv == 'C' || len == "l" || std::is_same_v<T, wchar_t>) {
+                    wchar_t ch[1] = { wchar_t(value) };
+                    put_wstr(out, { ch, 1 }, spec.field_width, -1, spec.flagset, lc);
+                }
+                else {
+                    char ch[1] = { char(value) };
+                    put_str(out, { ch, 1 }, spec, false);
+                }
+            }
+            else if constexpr (conv == 's' || conv == 'S')
+            {
+                if constexpr (std::is_pointer_v<T>) {
+                    // null prints like printf
+                    if (!value)
+                        return put_str(out, "(null)", spec);
+                }
+
+                if constexpr (is_narrow_string_v<T>)
+                    put_str(out, string_view(value), spec);
+                else if constexpr (is_wide_string_v<T>)
+                    put_wstr(out, wstring_view(value), spec.field_width, spec.precision, spec.flagset, lc);
+                else
+                    static_assert(always_false<T>, "%s takes a string argument");
+            }
+            else if constexpr (conv == 'p')
+            {
+                static_assert(std::is_pointer_v<T> || std::is_null_pointer_v<T>, "%p takes a pointer argument");
+
+                std::uintptr_t v = 0;
+                if constexpr (std::is_pointer_v<T>)
+                    v = reinterpret_cast<std::uintptr_t>(value);
+                put_int(out, std::uint64_t(v), false, 'p', spec.field_width, -1, spec.flagset, lc.data);
+            }
+            else
+            {
+                static_assert(always_false<T>, "unsupported conversion");
+            }
+        }
+
+        template<class S, size_t I, class Tuple>
+        void put_segment(sink& out, poly_locale const& lc, const Tuple& args)
+        {
+            constexpr auto& seg = plan_of<S>.seg[I];
+
+            if constexpr (!seg.is_spec)
+            {
+                out.write(S::value().data() + seg.begin, seg.size);
+            }
+            else
+            {
+                auto spec = seg.spec;
+
+                if constexpr (seg.width_arg >= 0)
+                {
+                    spec.field_width = star_arg(std::get<seg.width_arg>(args));
+
+                    // a negative width is a '-' flag followed by a positive width
+                    if (spec.field_width < 0) {
+                        spec.field_width = -spec.field_width;
+                        spec.flagset = fmt_flags(unsigned(spec.flagset) | unsigned(fmt_flags::left));
+                    }
+                }
+
+                if constexpr (seg.precision_arg >= 0)
+                {
+                    spec.precision = star_arg(std::get<seg.precision_arg>(args));
+                    if (spec.precision < 0)
+                        spec.precision = fmtspec_t::VAL_AUTO;
+                }
+
+                put_arg<S, I>(out, lc, spec, std::get<seg.value_arg>(args));
+            }
+        }
+
+        template<class S, class Tuple, size_t... I>
+        void put_all(sink& out, poly_locale const& lc, const Tuple& args, std::index_sequence<I...>)
+        {
+            (put_segment<S, I>(out, lc, args), ...);
+        }
+
+        // Writes into any output iterator through a small buffer.
+        template<class OutputIt>
+        class iterator_sink final : public sink
+        {
+        public:
+            explicit iterator_sink(OutputIt it) : sink(m_buf, m_buf + sizeof m_buf), m_it(it) {}
+
+            OutputIt flush()
+            {
+                m_it = std::copy(m_begin, m_pos, m_it);
+                m_count += size_t(m_pos - m_begin);
+                m_pos = m_begin;
+                return m_it;
+            }
+
+        private:
+            bool overflow(size_t) override
+            {
+                flush();
+                return true;
+            }
+
+            OutputIt m_it;
+            char m_buf[256];
+        };
+
+        // Formats into a small buffer of its own, moving to a string grown geometrically
+        // once that's full. Short output costs one exact allocation, if any.
+        class string_sink final : public sink
+        {
+        public:
+            string_sink() noexcept : sink(m_buf, m_buf + sizeof m_buf) {}
+
+            std::string finish()
+            {
+                auto const used = size_t(m_pos - m_begin);
+                if (m_begin == m_buf)
+                    return std::string(m_buf, used);
+
+                m_str.resize(used);
+                return std::move(m_str);
+            }
+
+        private:
+            bool overflow(size_t hint) override
+            {
+                auto const used = size_t(m_pos - m_begin);
+                auto const capacity = std::max(size_t(m_end - m_begin) * 2, used + hint);
+
+                if (m_begin == m_buf) {
+                    m_str.reserve(capacity);
+                    m_str.assign(m_buf, used);
+                }
+                m_str.resize(capacity);
+
+                m_begin = m_str.data();
+                m_pos = m_begin + used;
+                m_end = m_begin + capacity;
+                return true;
+            }
+
+            std::string m_str;
+            char m_buf[256];
+        };
+    }
+
+    // Formats 'args' into 'out' like the printf family, 'fmt' comes from POLYLOC_FMT.
+    // Returns the num. of chars written.
+    template<class S, class... Args>
+    size_t format_to(sink& out, poly_locale const& lc, S, const Args&... args)
+    {
+        static_assert(is_compile_string_v<S>, "use POLYLOC_FMT(\"...\") for the format");
+
+        using fmt_detail::plan_error;
+        constexpr auto& plan = fmt_detail::plan_of<S>;
+        static_assert(plan.error != plan_error::incomplete_spec, "the format has a '%' w/o a conversion");
+        static_assert(plan.error != plan_error::invalid_conversion, "the format has an invalid conversion spec");
+        static_assert(plan.error != plan_error::n_conversion, "%n is not supported");
+        static_assert(plan.error != plan_error::mixed_positions, "the format mixes \"%n$\" and unnumbered specs");
+        static_assert(plan.args == sizeof...(Args), "the num. of arguments doesn't match the format");
+
+        auto const start = out.size();
+        fmt_detail::put_all<S>(out, lc, std::forward_as_tuple(args...),
+                               std::make_index_sequence<fmt_detail::count_segments(S::value())>{});
+        return out.size() - start;
+    }
+
+    // Formats into an output iterator of char, a char* included, returns the iterator past the
+    // last char written. No null is added. 'loc' may be POLY_GLOBAL_LOCALE.
+    template<class OutputIt, class S, class... Args>
+    OutputIt format_to(OutputIt out, poly_locale_t loc, S fmt, const Args&... args)
+    {
+        auto const& lc = resolve_locale(loc);
+
+        fmt_detail::iterator_sink<OutputIt> is{ out };
+        format_to(is, lc, fmt, args...);
+        return is.flush();
+    }
+
+    // Same as format_to, returning a new string. 'loc' may be POLY_GLOBAL_LOCALE.
+    template<class S, class... Args>
+    std::string format(poly_locale_t loc, S fmt, const Args&... args)
+    {
+        fmt_detail::string_sink out;
+        format_to(out, resolve_locale(loc), fmt, args...);
+        return out.finish();
+    }
+}
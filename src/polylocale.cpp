@@ -1,49 +1,112 @@
 #include <locale>
-#include <sstream>
-#include <fstream>
-#include <iostream>
 #include <cstdio>
 #include <string>
 #include <memory>
 #include <algorithm>
+#include <utility>
+#include <atomic>
+#include <mutex>
 
 #include "polylocale.h"
 #include "impl/printf.hpp"
+#include "impl/scanf.hpp"
+#include "impl/printf_fmt.hpp"
+#include "impl/sink.hpp"
+#include "impl/locale.hpp"
+#include "impl/numparse.hpp"
+#include "impl/wcvt.hpp"
+#include "impl/stats.hpp"
 #include "impl/polyimpl.h"
 
-#ifdef __GNUC__
-#include <ext/stdio_filebuf.h>
-#endif
+struct poly_format : red::polyloc::compiled_fmt
+{
+    using basic_compiled_fmt::basic_compiled_fmt;
+};
+
+struct poly_buffer
+{
+    poly_buffer(char* storage, size_t capacity) noexcept : out(storage, capacity) {}
+
+    red::polyloc::buffer_sink out;
+};
 
-struct poly_locale
+// Snapshot of the global locale, taken on first use and retaken by polyloc_global_changed.
+// Threads keep their own reference to it along with the generation it belongs to, so
+// POLY_GLOBAL_LOCALE costs a load and a compare; no lock, no refcount writes.
+std::mutex g_global_mutex;
+poly_locale* g_global = nullptr; // holds a reference
+std::atomic<unsigned> g_global_gen{ 1 };
+
+// The locale installed by poly_uselocale, null means the global locale.
+thread_local poly_locale* tl_current = nullptr;
+// The one it replaced, the last poly_uselocale returned it so it's kept until the next swap
+thread_local poly_locale* tl_previous = nullptr;
+// This thread's g_global and its generation
+thread_local poly_locale* tl_global = nullptr;
+thread_local unsigned tl_global_gen = 0;
+
+// releases the references above when the thread exits
+struct thread_locale_owner
 {
-    std::locale loc;
-    std::string name;
+    bool armed = false;
+    ~thread_locale_owner() {
+        poly_freelocale(std::exchange(tl_current, nullptr));
+        poly_freelocale(std::exchange(tl_previous, nullptr));
+        poly_freelocale(std::exchange(tl_global, nullptr));
+    }
 };
 
-constexpr red::string_view TLL_UNSET = "__unset";
-thread_local poly_locale tl_locale = { std::locale::classic(), std::string(TLL_UNSET) };
+thread_local thread_locale_owner tl_owner;
 
 
 static auto make_polylocale(std::locale const& base) {
-    auto plc = std::make_unique<poly_locale>(poly_locale{ base, base.name() });
+    auto plc = std::make_unique<poly_locale>(base);
     return plc;
 }
 
-static auto copy_polylocale(poly_locale_t ploc) {
-    auto plc = std::make_unique<poly_locale>(*ploc);
-    return plc;
+static auto thread_locale() noexcept -> poly_locale_t
+{
+    return tl_current ? tl_current : POLY_GLOBAL_LOCALE;
+}
+
+static auto refresh_global() -> poly_locale*
+{
+    std::lock_guard lock{ g_global_mutex };
+
+    if (!g_global)
+        g_global = make_polylocale(std::locale()).release();
+
+    g_global->retain();
+    tl_owner.armed = true;
+    poly_freelocale(std::exchange(tl_global, g_global));
+    tl_global_gen = g_global_gen.load(std::memory_order_relaxed);
+
+    return tl_global;
+}
+
+static auto global_locale() -> poly_locale*
+{
+    if (tl_global_gen != g_global_gen.load(std::memory_order_relaxed))
+        return refresh_global();
+
+    return tl_global;
 }
 
-static auto getloc(poly_locale_t ploc) -> std::locale
+static auto getloc(poly_locale_t ploc) -> const poly_locale&
 {
     if (ploc == POLY_GLOBAL_LOCALE)
-        return {};
+        return *global_locale();
+
     if (!ploc) {
         throw std::invalid_argument("locale_t is null!");
     }
 
-    return ploc->loc;
+    return *ploc;
+}
+
+const poly_locale& red::polyloc::resolve_locale(poly_locale_t loc)
+{
+    return getloc(loc);
 }
 
 static auto mask_to_cat(int mask) noexcept -> std::locale::category
@@ -71,6 +134,47 @@ static auto mask_to_cat(int mask) noexcept -> std::locale::category
     return cat;
 }
 
+template<class Format>
+static int vsnprintf_impl(char* buffer, size_t count, Format const& fmt, poly_locale_t ploc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SNPRINTF };
+    red::polyloc::bounded_sink out{ buffer, count };
+
+    auto result = red::polyloc::do_printf(fmt, out, getloc(ploc), args);
+    out.finish();
+
+    stat.done(result);
+    return result;
+}
+
+template<class Format>
+static int vfprintf_impl(FILE* cfile, Format const& fmt, poly_locale_t loc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_FPRINTF };
+    red::polyloc::file_sink out{ cfile };
+
+    auto result = red::polyloc::do_printf(fmt, out, getloc(loc), args);
+    if (!out.flush())
+        result = -1;
+
+    stat.done(result);
+    return result;
+}
+
+// calls 'parse' w/ where to put the end, recording the chars it took
+template<class CharT, class F>
+static auto timed_strto(polyloc_stat_fn fn, const CharT* str, CharT** endptr, F&& parse)
+{
+    red::polyloc::timed_call stat{ fn };
+    CharT* end;
+    auto result = parse(&end);
+
+    if (endptr)
+        *endptr = end;
+    stat.done(end - str);
+    return result;
+}
+
 extern "C" {
 
 // https://pubs.opengroup.org/onlinepubs/9699919799/functions/newlocale.html
@@ -87,19 +191,18 @@ poly_locale_t poly_newlocale(int category_mask, const char* localename, poly_loc
 
         if (base)
         {
-            auto baseloc = getloc(base);
-            auto newloc = std::locale(baseloc, localename, cats);
-            *base = poly_locale{newloc, newloc.name()};
-            return base;
+            // locales are immutable, derive a new one and let go of the base.
+            // Other holders of 'base' keep seeing it unchanged.
+            auto& baseloc = getloc(base).loc;
+            auto plc = make_polylocale(std::locale(baseloc, localename, cats));
+            poly_freelocale(base);
+            return plc.release();
         }
         else
         {
-            auto lc = std::locale({}, localename, cats);
-            auto plc = make_polylocale(lc);
-
-            return plc.release();
+            return red::polyloc::intern_locale(localename, category_mask, cats);
         }
-        
+
     }
     catch(const std::bad_alloc&)
     {
@@ -115,20 +218,25 @@ poly_locale_t poly_newlocale(int category_mask, const char* localename, poly_loc
 
 // https://pubs.opengroup.org/onlinepubs/9699919799/functions/freelocale.html
 void poly_freelocale(poly_locale_t loc) {
-    delete loc;
+    if (loc && loc != POLY_GLOBAL_LOCALE && loc->release())
+        delete loc;
 }
 
 poly_locale_t poly_duplocale(poly_locale_t loc)
 {
     try
     {
-        if (loc == POLY_GLOBAL_LOCALE) {
-            auto plc = make_polylocale(std::locale());
-            return plc.release();
+        if (loc == POLY_GLOBAL_LOCALE)
+            loc = global_locale();
+
+        if (!loc) {
+            errno = EINVAL;
+            return nullptr;
         }
-        
-        auto plc = copy_polylocale(loc);
-        return plc.release();
+
+        // locales are immutable, a copy is just another reference
+        loc->retain();
+        return loc;
     }
     catch(const std::bad_alloc&)
     {
@@ -139,43 +247,96 @@ poly_locale_t poly_duplocale(poly_locale_t loc)
 
 poly_locale_t poly_uselocale(poly_locale_t nloc)
 {
+    auto const prev = thread_locale();
     if (!nloc)
-    {
-        return tl_locale.name == TLL_UNSET ? POLY_GLOBAL_LOCALE : &tl_locale;
-    }
+        return prev;
 
     if (nloc == POLY_GLOBAL_LOCALE)
     {
-        tl_locale.name = TLL_UNSET;
-        return POLY_GLOBAL_LOCALE;
+        nloc = nullptr;
+    }
+    else
+    {
+        // keep it alive while installed, even if it's freed meanwhile
+        nloc->retain();
     }
 
-    tl_locale = *nloc;
-    return &tl_locale;
+    // the caller gets 'prev' back, likely to reinstall it; it's released by the next swap
+    tl_owner.armed = true;
+    poly_freelocale(std::exchange(tl_previous, std::exchange(tl_current, nloc)));
+    return prev;
 }
 
 // ---
 
 double poly_strtod_l(const char* str, char** endptr, poly_locale_t ploc)
 {
-    std::istringstream ss{str};
-    ss.imbue(getloc(ploc));
+    return timed_strto(POLYLOC_STAT_STRTOD, str, endptr, [&](char** end) {
+        return red::polyloc::strto_fp<double>(str, end, getloc(ploc).data);
+    });
+}
 
-    double num;
-    ss >> num;
+float poly_strtof_l(const char* str, char** endptr, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOD, str, endptr, [&](char** end) {
+        return red::polyloc::strto_fp<float>(str, end, getloc(ploc).data);
+    });
+}
 
-    if (endptr)
-    {
-        if (ss.good()) {
-            std::streamoff pos = ss.tellg();
-            auto* end = str + pos;
-            *endptr = const_cast<char*>(end);
-        } else {
-            *endptr = const_cast<char*>(str);
-        }
-    }
+long double poly_strtold_l(const char* str, char** endptr, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOD, str, endptr, [&](char** end) {
+        return red::polyloc::strto_fp<long double>(str, end, getloc(ploc).data);
+    });
+}
+
+long poly_strtol_l(const char* str, char** endptr, int base, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOL, str, endptr, [&](char** end) {
+        return red::polyloc::strto_int<long>(str, end, base, getloc(ploc).data);
+    });
+}
+
+unsigned long poly_strtoul_l(const char* str, char** endptr, int base, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOL, str, endptr, [&](char** end) {
+        return red::polyloc::strto_int<unsigned long>(str, end, base, getloc(ploc).data);
+    });
+}
+
+long long poly_strtoll_l(const char* str, char** endptr, int base, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOL, str, endptr, [&](char** end) {
+        return red::polyloc::strto_int<long long>(str, end, base, getloc(ploc).data);
+    });
+}
+
+unsigned long long poly_strtoull_l(const char* str, char** endptr, int base, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOL, str, endptr, [&](char** end) {
+        return red::polyloc::strto_int<unsigned long long>(str, end, base, getloc(ploc).data);
+    });
+}
+
+double poly_wcstod_l(const wchar_t* str, wchar_t** endptr, poly_locale_t ploc)
+{
+    return timed_strto(POLYLOC_STAT_STRTOD, str, endptr, [&](wchar_t** end) {
+        return red::polyloc::strto_fp<double>(str, end, getloc(ploc).data);
+    });
+}
+
+size_t poly_parse_doubles_l(const char* buf, size_t len, char delim, double* out, size_t n,
+                            unsigned char* errors, const char** endptr, poly_locale_t ploc)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_PARSE_DOUBLES };
+    auto const& lc = getloc(ploc).data;
+    const char* end;
+    auto result = red::polyloc::parse_fp_fields(buf, buf + len, delim, out, n, errors, &end, lc);
 
-    return num;
+    if (endptr)
+        *endptr = end;
+    stat.done(end - buf);
+    return result;
 }
 
 
@@ -193,12 +354,7 @@ int poly_printf_l(const char* fmt, poly_locale_t locale, ...)
 
 int poly_vprintf_l(const char* fmt, poly_locale_t locale, va_list args)
 {
-    std::ostringstream tmp;
-    red::polyloc::do_printf(fmt, tmp, getloc(locale), args);
-    auto contents = tmp.str();
-    auto result = (int)contents.size();
-    std::cout << contents;
-    return result;
+    return vfprintf_impl(stdout, red::string_view(fmt), locale, args);
 }
 
 
@@ -216,11 +372,13 @@ int poly_sprintf_l(char* buffer, const char* fmt, poly_locale_t loc, ...)
 
 int poly_vsprintf_l(char* buffer, const char* fmt, poly_locale_t loc, va_list args)
 {
-    std::ostringstream tmp;
-    red::polyloc::do_printf(fmt, tmp, getloc(loc), args);
-    auto contents = tmp.str();
-    int result = contents.copy(buffer, contents.size());
-    buffer[contents.size()] = '\0';
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SNPRINTF };
+    red::polyloc::pointer_sink out{ buffer };
+
+    auto result = red::polyloc::do_printf(fmt, out, getloc(loc), args);
+    out.finish();
+
+    stat.done(result);
     return result;
 }
 
@@ -238,16 +396,43 @@ int poly_snprintf_l(char* buffer, size_t count, const char* format, poly_locale_
 
 int poly_vsnprintf_l(char* buffer, size_t count, const char* fmt, poly_locale_t ploc, va_list args)
 {
-    red::io::array_buf outputBuf (buffer, count);
-    std::ostream outs(&outputBuf);
+    return vsnprintf_impl(buffer, count, red::string_view(fmt), ploc, args);
+}
 
-    auto result = red::polyloc::do_printf(fmt, outs, count, getloc(ploc), args);
-    outs.put('\0');
 
-    return result.first;
+int poly_asprintf_l(char** strp, const char* fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vasprintf_l(strp, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
 }
 
+int poly_vasprintf_l(char** strp, const char* fmt, poly_locale_t loc, va_list args)
+{
+    if (!strp) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SNPRINTF };
+    char storage[512];
+    red::polyloc::buffer_sink out{ storage, sizeof storage };
+
+    auto result = red::polyloc::do_printf(red::string_view(fmt), out, getloc(loc), args);
+    *strp = result >= 0 ? out.release() : nullptr;
+    if (!*strp && result >= 0) {
+        errno = ENOMEM;
+        result = -1;
+    }
 
+    stat.done(result);
+    return result;
+}
 int poly_fprintf_l(FILE* fs, const char* format, poly_locale_t locale, ...)
 {
     int result;
@@ -261,34 +446,430 @@ int poly_fprintf_l(FILE* fs, const char* format, poly_locale_t locale, ...)
 }
 
 int poly_vfprintf_l(FILE* cfile, const char* fmt, poly_locale_t loc, va_list args)
+{
+    return vfprintf_impl(cfile, red::string_view(fmt), loc, args);
+}
+
+int poly_dprintf_l(int fd, const char* fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vdprintf_l(fd, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vdprintf_l(int fd, const char* fmt, poly_locale_t loc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_FPRINTF };
+    red::polyloc::fd_sink out{ fd };
+
+    auto result = red::polyloc::do_printf(red::string_view(fmt), out, getloc(loc), args);
+    if (!out.flush())
+        result = -1;
+
+    stat.done(result);
+    return result;
+}
+
+size_t poly_dprintf_batch(size_t threshold)
+{
+    return red::polyloc::set_fd_batch(threshold);
+}
+
+int poly_dprintf_flush(void)
+{
+    return red::polyloc::flush_fd_batch() ? 0 : -1;
+}
+
+// --- wide
+
+int poly_swprintf_l(wchar_t* buffer, size_t count, const wchar_t* fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vswprintf_l(buffer, count, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vswprintf_l(wchar_t* buffer, size_t count, const wchar_t* fmt, poly_locale_t loc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SWPRINTF };
+    red::polyloc::wbounded_sink out{ buffer, count };
+
+    auto result = red::polyloc::do_printf(red::wstring_view(fmt), out, getloc(loc), args);
+    out.finish();
+    stat.done(result * (long long)sizeof(wchar_t));
+
+    // unlike snprintf, truncation is an error
+    return size_t(result) < count ? result : -1;
+}
+
+int poly_fwprintf_l(FILE* cfile, const wchar_t* fmt, poly_locale_t loc, ...)
 {
     int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vfwprintf_l(cfile, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vfwprintf_l(FILE* cfile, const wchar_t* fmt, poly_locale_t loc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_FWPRINTF };
+    auto const& lc = getloc(loc);
+    red::polyloc::file_sink bytes{ cfile };
+    int result;
+    {
+        red::polyloc::encoding_sink out{ bytes, lc };
+        result = red::polyloc::do_printf(red::wstring_view(fmt), out, lc, args);
+    }
+
+    if (!bytes.flush())
+        result = -1;
+    stat.done((long long)bytes.size());
+    return result;
+}
+
+// --- poly_buffer
+
+poly_buffer_t poly_new_buffer(char* storage, size_t capacity)
+{
+    try
+    {
+        return new poly_buffer(storage, capacity);
+    }
+    catch (const std::bad_alloc&)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
 
-    // convert FILE* to ostream
-#if defined(_MSC_VER)
-    auto outs = std::ofstream(cfile);
-    result = red::polyloc::do_printf(fmt, outs, getloc(loc), args);
-#elif defined(__GNUC__)
-    __gnu_cxx::stdio_filebuf<char> fbuf{ cfile, std::ios::out };
-    std::ostream outs{ &fbuf };
-    result = red::polyloc::do_printf(fmt, outs, getloc(loc), args);
-#else
-    // Fallback
-    std::ostringstream outs;
-    red::polyloc::do_printf(fmt, outs, getloc(loc), args);
-    auto contents = outs.str();
-    result = std::fputs(contents.c_str(), cfile);
-    if (result != EOF) {
-        result = (int)contents.size();
-    }
-#endif
+void poly_free_buffer(poly_buffer_t buf) {
+    delete buf;
+}
 
+int poly_buffer_printf_l(poly_buffer_t buf, const char* fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_buffer_vprintf_l(buf, fmt, loc, va);
+    }
+    va_end(va);
     return result;
 }
 
+int poly_buffer_vprintf_l(poly_buffer_t buf, const char* fmt, poly_locale_t loc, va_list args)
+{
+    if (!buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SNPRINTF };
+    auto const before = buf->out.length();
+
+    auto result = red::polyloc::do_printf(red::string_view(fmt), buf->out, getloc(loc), args);
+    if (buf->out.failed()) {
+        // all or nothing
+        buf->out.truncate(before);
+        errno = ENOMEM;
+        result = -1;
+    }
+
+    stat.done(result);
+    return result;
+}
+
+const char* poly_buffer_data(poly_buffer_t buf)
+{
+    return buf ? buf->out.data() : nullptr;
+}
+
+size_t poly_buffer_size(poly_buffer_t buf)
+{
+    return buf ? buf->out.length() : 0;
+}
+
+void poly_buffer_clear(poly_buffer_t buf)
+{
+    if (buf)
+        buf->out.clear();
+}
+
+// --- scanf
+
+int poly_sscanf_l(const char* str, const char* fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vsscanf_l(str, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vsscanf_l(const char* str, const char* fmt, poly_locale_t loc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SSCANF };
+    size_t consumed = 0;
+    auto result = red::polyloc::do_scanf(fmt, str, getloc(loc), args, &consumed);
+
+    stat.done((long long)consumed);
+    return result;
+}
+
+int poly_fscanf_l(FILE* cfile, const char* fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vfscanf_l(cfile, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vfscanf_l(FILE* cfile, const char* fmt, poly_locale_t loc, va_list args)
+{
+    red::polyloc::timed_call stat{ POLYLOC_STAT_FSCANF };
+    size_t consumed = 0;
+    auto result = red::polyloc::do_scanf(fmt, cfile, getloc(loc), args, &consumed);
+
+    stat.done((long long)consumed);
+    return result;
+}
+
+// --- thread locale
+
+double poly_strtod(const char* str, char** endptr)
+{
+    return poly_strtod_l(str, endptr, thread_locale());
+}
+
+int poly_printf(const char* fmt, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, fmt);
+    {
+        result = poly_vprintf_l(fmt, thread_locale(), va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vprintf(const char* fmt, va_list args)
+{
+    return poly_vprintf_l(fmt, thread_locale(), args);
+}
+
+int poly_snprintf(char* buffer, size_t count, const char* fmt, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, fmt);
+    {
+        result = poly_vsnprintf_l(buffer, count, fmt, thread_locale(), va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vsnprintf(char* buffer, size_t count, const char* fmt, va_list args)
+{
+    return poly_vsnprintf_l(buffer, count, fmt, thread_locale(), args);
+}
+
+int poly_fprintf(FILE* cfile, const char* fmt, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, fmt);
+    {
+        result = poly_vfprintf_l(cfile, fmt, thread_locale(), va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vfprintf(FILE* cfile, const char* fmt, va_list args)
+{
+    return poly_vfprintf_l(cfile, fmt, thread_locale(), args);
+}
+
+// ---
+
+poly_format_t poly_compile_format(const char* fmt)
+{
+    if (!fmt) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    try
+    {
+        auto pfmt = std::make_unique<poly_format>(fmt);
+        return pfmt.release();
+    }
+    catch(const std::bad_alloc&)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+poly_format_t poly_compile_scan_format(const char* fmt)
+{
+    if (!fmt) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    try
+    {
+        auto pfmt = std::make_unique<poly_format>(fmt, red::polyloc::fmt_kind::scan);
+        return pfmt.release();
+    }
+    catch(const std::bad_alloc&)
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+void poly_free_format(poly_format_t fmt) {
+    delete fmt;
+}
+
+int poly_snprintf_compiled_l(char* buffer, size_t count, poly_format_t fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vsnprintf_compiled_l(buffer, count, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vsnprintf_compiled_l(char* buffer, size_t count, poly_format_t fmt, poly_locale_t loc, va_list args)
+{
+    if (fmt->kind() != red::polyloc::fmt_kind::print) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return vsnprintf_impl(buffer, count, *fmt, loc, args);
+}
+
+int poly_fprintf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t locale, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, locale);
+    {
+        result = poly_vfprintf_compiled_l(cfile, fmt, locale, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vfprintf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t locale, va_list args)
+{
+    if (fmt->kind() != red::polyloc::fmt_kind::print) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return vfprintf_impl(cfile, *fmt, locale, args);
+}
+
+int poly_sscanf_compiled_l(const char* str, poly_format_t fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vsscanf_compiled_l(str, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vsscanf_compiled_l(const char* str, poly_format_t fmt, poly_locale_t loc, va_list args)
+{
+    if (fmt->kind() != red::polyloc::fmt_kind::scan) {
+        errno = EINVAL;
+        return EOF;
+    }
+
+    red::polyloc::timed_call stat{ POLYLOC_STAT_SSCANF };
+    size_t consumed = 0;
+    auto result = red::polyloc::do_scanf(*fmt, str, getloc(loc), args, &consumed);
+
+    stat.done((long long)consumed);
+    return result;
+}
+
+int poly_fscanf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t loc, ...)
+{
+    int result;
+    va_list va;
+    va_start(va, loc);
+    {
+        result = poly_vfscanf_compiled_l(cfile, fmt, loc, va);
+    }
+    va_end(va);
+    return result;
+}
+
+int poly_vfscanf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t loc, va_list args)
+{
+    if (fmt->kind() != red::polyloc::fmt_kind::scan) {
+        errno = EINVAL;
+        return EOF;
+    }
+
+    red::polyloc::timed_call stat{ POLYLOC_STAT_FSCANF };
+    size_t consumed = 0;
+    auto result = red::polyloc::do_scanf(*fmt, cfile, getloc(loc), args, &consumed);
+
+    stat.done((long long)consumed);
+    return result;
+}
+
+// ---
+
 const char* polyloc_getname(poly_locale_t l)
 {
-    return l->name.c_str();
+    return getloc(l).name.c_str();
+}
+
+void polyloc_global_changed(void)
+{
+    auto plc = make_polylocale(std::locale());
+
+    std::lock_guard lock{ g_global_mutex };
+    poly_freelocale(std::exchange(g_global, plc.release()));
+    g_global_gen.fetch_add(1, std::memory_order_relaxed);
 }
 
 } // extern C
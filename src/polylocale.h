@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <wchar.h>
 
 #include "config.h"
 
@@ -20,27 +21,160 @@ struct poly_locale;
 
 typedef struct poly_locale* poly_locale_t;
 
+struct poly_format;
+
+typedef struct poly_format* poly_format_t;
+
+struct poly_buffer;
+
+typedef struct poly_buffer* poly_buffer_t;
+
 // locale_t management
 poly_locale_t poly_newlocale(int category_mask, const char* localename, poly_locale_t base);
 void poly_freelocale(poly_locale_t loc);
 poly_locale_t poly_duplocale(poly_locale_t loc);
+// The thread holds its own reference to 'nloc' while installed, it may be freed meanwhile.
+// The returned locale stays valid until the thread's next poly_uselocale w/ a non-null
+// 'nloc', so 'old = poly_uselocale(x); ... poly_uselocale(old);' is safe. To keep it
+// longer, poly_duplocale it.
 poly_locale_t poly_uselocale(poly_locale_t nloc);
 
 // deserialization
 double poly_strtod_l(const char* str, char** endptr, poly_locale_t loc);
-
-// printf family
+float poly_strtof_l(const char* str, char** endptr, poly_locale_t loc);
+long double poly_strtold_l(const char* str, char** endptr, poly_locale_t loc);
+long poly_strtol_l(const char* str, char** endptr, int base, poly_locale_t loc);
+unsigned long poly_strtoul_l(const char* str, char** endptr, int base, poly_locale_t loc);
+long long poly_strtoll_l(const char* str, char** endptr, int base, poly_locale_t loc);
+unsigned long long poly_strtoull_l(const char* str, char** endptr, int base, poly_locale_t loc);
+double poly_wcstod_l(const wchar_t* str, wchar_t** endptr, poly_locale_t loc);
+
+// bulk deserialization
+// parses up to 'n' 'delim' or newline separated numbers from 'buf' into 'out', returns how many.
+// 'errors' (optional, n/8 rounded up bytes) gets a set bit for each field that isn't a valid number.
+// 'endptr' (optional) gets where the next field starts, to resume from.
+size_t poly_parse_doubles_l(const char* buf, size_t len, char delim, double* out, size_t n,
+                            unsigned char* errors, const char** endptr, poly_locale_t loc);
+
+// printf family, "%n$" argument positions (POSIX) are supported
 int poly_printf_l(const char* fmt, poly_locale_t locale, ...);
 int poly_vprintf_l(const char* fmt, poly_locale_t locale, va_list args);
 int poly_sprintf_l(char* buffer, const char* fmt, poly_locale_t loc, ...);
 int poly_vsprintf_l(char* buffer, const char* fmt, poly_locale_t locale, va_list args);
 int poly_snprintf_l(char* buffer, size_t count, const char* fmt, poly_locale_t loc, ...);
 int poly_vsnprintf_l(char* buffer, size_t count, const char* fmt, poly_locale_t loc, va_list args);
+// sets '*strp' to a malloc'ed string w/ the output, to be free()d. On error it's set to NULL and -1 returned.
+int poly_asprintf_l(char** strp, const char* fmt, poly_locale_t loc, ...);
+int poly_vasprintf_l(char** strp, const char* fmt, poly_locale_t loc, va_list args);
 int poly_fprintf_l(FILE* cfile, const char* fmt, poly_locale_t locale, ...);
 int poly_vfprintf_l(FILE* cfile, const char* fmt, poly_locale_t locale, va_list args);
+// to a file descriptor, one write() per call unless the output is large
+int poly_dprintf_l(int fd, const char* fmt, poly_locale_t loc, ...);
+int poly_vdprintf_l(int fd, const char* fmt, poly_locale_t loc, va_list args);
+// Makes the calling thread's dprintf calls queue up to 'threshold' bytes and write them
+// together once it's exceeded, or by poly_dprintf_flush. 0 flushes and writes right away again.
+// Returns the previous threshold. Call poly_dprintf_flush before closing the fd and before the
+// thread exits, output still queued when the thread exits is dropped.
+size_t poly_dprintf_batch(size_t threshold);
+// writes the calling thread's queued output, returns -1 if a batched write failed since the last call
+int poly_dprintf_flush(void);
+
+// wide printf family, %s takes a multibyte string and %ls a wide one.
+// swprintf returns -1 if the output didn't fit, fwprintf writes the multibyte encoding of 'loc'.
+int poly_swprintf_l(wchar_t* buffer, size_t count, const wchar_t* fmt, poly_locale_t loc, ...);
+int poly_vswprintf_l(wchar_t* buffer, size_t count, const wchar_t* fmt, poly_locale_t loc, va_list args);
+int poly_fwprintf_l(FILE* cfile, const wchar_t* fmt, poly_locale_t loc, ...);
+int poly_vfwprintf_l(FILE* cfile, const wchar_t* fmt, poly_locale_t loc, va_list args);
+
+// scanf family, numbers are read like the strto*_l functions. The ' flag takes grouped numbers.
+int poly_sscanf_l(const char* str, const char* fmt, poly_locale_t loc, ...);
+int poly_vsscanf_l(const char* str, const char* fmt, poly_locale_t loc, va_list args);
+int poly_fscanf_l(FILE* cfile, const char* fmt, poly_locale_t loc, ...);
+int poly_vfscanf_l(FILE* cfile, const char* fmt, poly_locale_t loc, va_list args);
+
+// thread locale versions, format/parse with the locale set by poly_uselocale
+double poly_strtod(const char* str, char** endptr);
+int poly_printf(const char* fmt, ...);
+int poly_vprintf(const char* fmt, va_list args);
+int poly_snprintf(char* buffer, size_t count, const char* fmt, ...);
+int poly_vsnprintf(char* buffer, size_t count, const char* fmt, va_list args);
+int poly_fprintf(FILE* cfile, const char* fmt, ...);
+int poly_vfprintf(FILE* cfile, const char* fmt, va_list args);
+
+// compiled formats
+poly_format_t poly_compile_format(const char* fmt);
+void poly_free_format(poly_format_t fmt);
+int poly_snprintf_compiled_l(char* buffer, size_t count, poly_format_t fmt, poly_locale_t loc, ...);
+int poly_vsnprintf_compiled_l(char* buffer, size_t count, poly_format_t fmt, poly_locale_t loc, va_list args);
+int poly_fprintf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t locale, ...);
+int poly_vfprintf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t locale, va_list args);
+// scan formats are compiled separately, the functions above don't take them and vice-versa
+poly_format_t poly_compile_scan_format(const char* fmt);
+int poly_sscanf_compiled_l(const char* str, poly_format_t fmt, poly_locale_t loc, ...);
+int poly_vsscanf_compiled_l(const char* str, poly_format_t fmt, poly_locale_t loc, va_list args);
+int poly_fscanf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t loc, ...);
+int poly_vfscanf_compiled_l(FILE* cfile, poly_format_t fmt, poly_locale_t loc, va_list args);
+
+// growable output buffers, for building a string from many printf calls.
+// 'storage' (optional, 'capacity' includes the null) is used until it's full, then the contents move to the heap.
+// Clearing keeps the capacity, so a reused buffer stops allocating.
+poly_buffer_t poly_new_buffer(char* storage, size_t capacity);
+void poly_free_buffer(poly_buffer_t buf);
+// appends to 'buf', returns the num. of chars added. Out of memory, nothing is added and -1 returned.
+int poly_buffer_printf_l(poly_buffer_t buf, const char* fmt, poly_locale_t loc, ...);
+int poly_buffer_vprintf_l(poly_buffer_t buf, const char* fmt, poly_locale_t loc, va_list args);
+// the null terminated contents, valid until the next change to 'buf'
+const char* poly_buffer_data(poly_buffer_t buf);
+size_t poly_buffer_size(poly_buffer_t buf);
+void poly_buffer_clear(poly_buffer_t buf);
 
 // polyloc specific
 const char* polyloc_getname(poly_locale_t l);
+// POLY_GLOBAL_LOCALE is a snapshot of the C++ global locale, call this after changing it.
+// std::locale::global() alone isn't seen: checking std::locale() would cost a lock per call.
+void polyloc_global_changed(void);
+
+// statistics, off until polyloc_stats_enable(1). Counters are kept per thread and summed
+// by polyloc_stats_get, which also includes threads that already exited.
+enum polyloc_stat_fn
+{
+    POLYLOC_STAT_SNPRINTF,      // sprintf, snprintf, asprintf, buffer_printf and their compiled/thread locale versions
+    POLYLOC_STAT_FPRINTF,       // fprintf, printf, dprintf
+    POLYLOC_STAT_SWPRINTF,
+    POLYLOC_STAT_FWPRINTF,
+    POLYLOC_STAT_STRTOD,        // strtod, strtof, strtold, wcstod
+    POLYLOC_STAT_STRTOL,        // strtol, strtoul, strtoll, strtoull
+    POLYLOC_STAT_PARSE_DOUBLES,
+    POLYLOC_STAT_SSCANF,
+    POLYLOC_STAT_FSCANF,
+    POLYLOC_STAT_PARSEFMT,      // parsing a format, also part of the time of the call that needed it
+
+    POLYLOC_STAT_FN_COUNT
+};
+
+#define POLYLOC_STAT_BUCKETS 32
+// the clock is read for 1 in this many calls (a power of 2), parsefmt is always timed
+#define POLYLOC_STAT_LATENCY_SAMPLE 16
+
+struct polyloc_fn_stats
+{
+    unsigned long long calls;
+    unsigned long long bytes; // written by printf, read by strto*, scanf and parsefmt (format length)
+    unsigned long long latency[POLYLOC_STAT_BUCKETS]; // [i] counts timed calls that took [2^(i-1), 2^i) ns, the last one the slower
+};
+
+struct polyloc_stats
+{
+    struct polyloc_fn_stats fn[POLYLOC_STAT_FN_COUNT];
+    unsigned long long fmt_cache_hits, fmt_cache_misses;
+    unsigned long long registry_hits, registry_misses; // poly_newlocale w/o a base
+};
+
+// returns if they were enabled
+int polyloc_stats_enable(int enable);
+// totals since the last reset
+void polyloc_stats_get(struct polyloc_stats* out);
+void polyloc_stats_reset(void);
 
 
 enum poly_lc_masks
@@ -67,14 +201,33 @@ enum poly_lc_masks
 #define freelocale      poly_freelocale
 #define duplocale       poly_duplocale
 #define strtod_l        poly_strtod_l
+#define strtof_l        poly_strtof_l
+#define strtold_l       poly_strtold_l
+#define strtol_l        poly_strtol_l
+#define strtoul_l       poly_strtoul_l
+#define strtoll_l       poly_strtoll_l
+#define strtoull_l      poly_strtoull_l
+#define wcstod_l        poly_wcstod_l
 #define printf_l        poly_printf_l
 #define vprintf_l       poly_vprintf_l
 #define fprintf_l       poly_fprintf_l
 #define vfprintf_l      poly_vfprintf_l
+#define dprintf_l       poly_dprintf_l
+#define vdprintf_l      poly_vdprintf_l
 #define sprintf_l       poly_sprintf_l
 #define vsprintf_l      poly_vsprintf_l
 #define snprintf_l      poly_snprintf_l
 #define vsnprintf_l     poly_vsnprintf_l
+#define asprintf_l      poly_asprintf_l
+#define vasprintf_l     poly_vasprintf_l
+#define swprintf_l      poly_swprintf_l
+#define vswprintf_l     poly_vswprintf_l
+#define fwprintf_l      poly_fwprintf_l
+#define vfwprintf_l     poly_vfwprintf_l
+#define sscanf_l        poly_sscanf_l
+#define vsscanf_l       poly_vsscanf_l
+#define fscanf_l        poly_fscanf_l
+#define vfscanf_l       poly_vfscanf_l
 
 #define LC_GLOBAL_LOCALE    POLY_GLOBAL_LOCALE
 
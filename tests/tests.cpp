@@ -5,8 +5,14 @@
 #include <vector>
 #include <cstddef>
 #include <locale>
+#include <cmath>
+#include <cstdint>
+#include <cerrno>
+#include <thread>
+#include <iterator>
 
 #include "polylocale.h"
+#include "polyformat.hpp"
 #include "boost/utility/string_view.hpp"
 #define CATCH_CONFIG_RUNNER
 #include "catch.hpp"
@@ -184,6 +190,11 @@ TEST_CASE("Formating integers", "[sprintf][format]")
     TEST_FMT("what? 22", "what? %zi", 22);
     TEST_FMT("100% win rate!", "%d%% win rate!", 100);
     TEST_FMT("+1024 -768", "%+lli % ld", 1024ll, -768l);
+    TEST_FMT("-9223372036854775808 ffffffffffffffff", "%lld %llx", INT64_MIN, UINT64_MAX);
+    TEST_FMT("-1 255 65535", "%hhd %hhu %hu", 255, 255, -1);
+    TEST_FMT("-42  |0x002a|  052", "%-5d|%#06x|%#5o", -42, 42u, 42u);
+    TEST_FMT("ab   |42   ", "%-05s|%-05d", "ab", 42);
+    TEST_FMT("(null)", "%s", (char*)NULL);
 }
 
 TEST_CASE("Formating floating point", "[sprintf][format]")
@@ -221,6 +232,11 @@ TEST_CASE("Formating floating point", "[sprintf][format]")
     TEST_FMT("1", "%.0g", 1.2);
     TEST_FMT(" 3.7 3.71", "% .3g %.3g", 3.704, 3.706);
     TEST_FMT("2e-315:1e+308", "%g:%g", 2e-315, 1e+308);
+    TEST_FMT("0x1.8p+1 0X1.00P-2", "%a %.2A", 3.0, 0.25);
+    TEST_FMT("4.00 1.e+02 3.", "%#.3g %#.0e %#.0f", 4.0, 123.0, 3.0);
+    TEST_FMT("  inf|-INF|nan  ", "%05f|%E|%-5g", HUGE_VAL, -HUGE_VAL, NAN);
+    TEST_FMT("1.5  |", "%*.1f|", -5, 1.5);
+    TEST_FMT("1.50      |-2e+00    |", "%-010.2f|%-0*.0e|", 1.5, 10, -2.0);
 }
 
 TEST_CASE("(new|free|dup)locale", "[polyC]") {
@@ -231,19 +247,181 @@ TEST_CASE("(new|free|dup)locale", "[polyC]") {
 
     auto ploc_copy = poly_duplocale(ploc);
     REQUIRE(polyloc_getname(ploc_copy) == locname);
-    REQUIRE(ploc != ploc_copy);
 
+    // 'ploc_copy' keeps the locale alive while another one is derived from 'ploc'
+    auto ploc_derived = poly_newlocale(POLY_NUMERIC_MASK, locname.data(), ploc);
+    REQUIRE(ploc_derived != ploc_copy);
+    REQUIRE(polyloc_getname(ploc_copy) == locname);
+
+    ploc = poly_duplocale(ploc_copy);
+    REQUIRE(ploc == ploc_copy);
+
+    poly_freelocale(ploc_derived);
     poly_freelocale(ploc_copy);
 
     locname = COMMA_LC;
 
+    // 'ploc' is consumed
     auto ploc_base = poly_newlocale(POLY_NUMERIC_MASK | POLY_COLLATE_MASK, locname.data(), ploc);
     string_view ploc_name = polyloc_getname(ploc_base);
     REQUIRE(ploc_base);
-    REQUIRE(ploc_base == ploc);
     CHECK(ploc_name.find(locname) != string_view::npos);
 
+    poly_freelocale(ploc_base);
+}
+
+TEST_CASE("Locale registry", "[polyC]")
+{
+    auto a = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    auto b = locale_ptr(poly_newlocale(POLY_ALL_MASK, "POSIX", NULL));
+    REQUIRE(a.get() == b.get());
+
+    auto numeric = locale_ptr(poly_newlocale(POLY_NUMERIC_MASK, "C", NULL));
+    REQUIRE(numeric.get() != a.get());
+
+    SECTION("codeset spellings") {
+        auto utf8 = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C.UTF-8", NULL));
+        if (utf8) {
+            auto utf8_2 = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C.utf8", NULL));
+            REQUIRE(utf8.get() == utf8_2.get());
+        }
+    }
+
+    SECTION("derived locales aren't shared") {
+        auto base = poly_newlocale(POLY_ALL_MASK, "C", NULL);
+        auto derived = locale_ptr(poly_newlocale(POLY_NUMERIC_MASK, "C", base));
+        REQUIRE(derived.get() != a.get());
+        REQUIRE(polyloc_getname(a.get()) == string_view("C"));
+    }
+}
+
+TEST_CASE("uselocale", "[polyC]")
+{
+    REQUIRE(poly_uselocale(NULL) == POLY_GLOBAL_LOCALE);
+
+    auto ploc = poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL);
+    REQUIRE(poly_uselocale(ploc) == POLY_GLOBAL_LOCALE);
+    REQUIRE(poly_uselocale(NULL) == ploc);
+
+    // the thread keeps its own reference
     poly_freelocale(ploc);
+
+    char buffer[32];
+    REQUIRE(poly_snprintf(buffer, sizeof buffer, "%.2f|%d", 1.5, 42) == 7);
+    REQUIRE(string_view(buffer) == "1.50|42");
+    REQUIRE(poly_strtod("2.5", NULL) == 2.5);
+
+    REQUIRE(poly_uselocale(POLY_GLOBAL_LOCALE) == ploc);
+    REQUIRE(poly_uselocale(NULL) == POLY_GLOBAL_LOCALE);
+
+    SECTION("restoring a locale freed while installed") {
+        auto installed = poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL);
+        poly_uselocale(installed);
+        poly_freelocale(installed);
+
+        // the thread's reference was the last one, the returned locale must still be usable
+        auto old = poly_uselocale(POLY_GLOBAL_LOCALE);
+        REQUIRE(old == installed);
+        REQUIRE(poly_uselocale(old) == POLY_GLOBAL_LOCALE);
+        REQUIRE(poly_snprintf(buffer, sizeof buffer, "%.1f", 0.5) == 3);
+        REQUIRE(polyloc_getname(old) == POINT_LC);
+
+        poly_uselocale(POLY_GLOBAL_LOCALE);
+    }
+}
+
+TEST_CASE("Global locale", "[polyC]")
+{
+    auto const global = std::locale();
+    auto const name = global.name();
+    REQUIRE(polyloc_getname(POLY_GLOBAL_LOCALE) == name);
+
+    std::locale::global(std::locale(POINT_LC));
+    polyloc_global_changed();
+    CHECK(polyloc_getname(POLY_GLOBAL_LOCALE) == std::locale().name());
+
+    char buffer[32];
+    REQUIRE(poly_snprintf_l(buffer, sizeof buffer, "%.1f", POLY_GLOBAL_LOCALE, 0.5) == 3);
+    REQUIRE(string_view(buffer) == "0.5");
+
+    std::locale::global(global);
+    polyloc_global_changed();
+    REQUIRE(polyloc_getname(POLY_GLOBAL_LOCALE) == name);
+}
+
+TEST_CASE("Statistics", "[polyC][stats]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL));
+    auto const was_on = polyloc_stats_enable(1);
+    polyloc_stats_reset();
+
+    char buffer[32];
+    for (int i = 0; i < 20; i++)
+        poly_snprintf_l(buffer, sizeof buffer, "%d|", loc.get(), i);
+
+    // counters of exited threads are kept
+    std::thread([&] { poly_strtod_l("2.5e1;", NULL, loc.get()); }).join();
+
+    polyloc_stats stats;
+    polyloc_stats_get(&stats);
+
+    auto const& snprintf_stats = stats.fn[POLYLOC_STAT_SNPRINTF];
+    REQUIRE(snprintf_stats.calls == 20);
+    REQUIRE(snprintf_stats.bytes == 10 * 2 + 10 * 3);
+    REQUIRE(stats.fmt_cache_hits + stats.fmt_cache_misses == 20);
+
+    unsigned long long timed = 0;
+    for (auto n : snprintf_stats.latency)
+        timed += n;
+    // a sample, where it starts depends on this thread's earlier calls
+    REQUIRE(timed >= 20 / POLYLOC_STAT_LATENCY_SAMPLE);
+    REQUIRE(timed <= 20 / POLYLOC_STAT_LATENCY_SAMPLE + 1);
+
+    REQUIRE(stats.fn[POLYLOC_STAT_STRTOD].calls == 1);
+    REQUIRE(stats.fn[POLYLOC_STAT_STRTOD].bytes == 5);
+
+    SECTION("sprintf and sscanf") {
+        polyloc_stats_reset();
+        poly_sprintf_l(buffer, "%s", loc.get(), "abc");
+        int a = 0, b = 0;
+        poly_sscanf_l("12 345 rest", "%d%d", loc.get(), &a, &b);
+
+        polyloc_stats_get(&stats);
+        REQUIRE(stats.fn[POLYLOC_STAT_SNPRINTF].calls == 1);
+        REQUIRE(stats.fn[POLYLOC_STAT_SNPRINTF].bytes == 3);
+        REQUIRE(stats.fn[POLYLOC_STAT_SSCANF].calls == 1);
+        REQUIRE(stats.fn[POLYLOC_STAT_SSCANF].bytes == 6);
+    }
+
+    SECTION("format cache w/ many transient formats") {
+        // formats built in heap buffers used to fill the cache for good
+        std::vector<std::string> built;
+        for (int i = 0; i < 4000; i++)
+            built.push_back("%d|" + std::to_string(i));
+        for (auto& fmt : built)
+            poly_snprintf_l(buffer, sizeof buffer, fmt.c_str(), loc.get(), 1);
+
+        static const char kept[] = "%d;";
+        polyloc_stats_reset();
+        for (int i = 0; i < 3; i++)
+            poly_snprintf_l(buffer, sizeof buffer, kept, loc.get(), i);
+
+        polyloc_stats_get(&stats);
+        REQUIRE(stats.fmt_cache_misses == 1);
+        REQUIRE(stats.fmt_cache_hits == 2);
+        REQUIRE(buffer == std::string("2;"));
+    }
+
+    polyloc_stats_reset();
+    polyloc_stats_get(&stats);
+    REQUIRE(stats.fn[POLYLOC_STAT_SNPRINTF].calls == 0);
+
+    polyloc_stats_enable(0);
+    poly_snprintf_l(buffer, sizeof buffer, "%d|", loc.get(), 1);
+    polyloc_stats_get(&stats);
+    REQUIRE(stats.fn[POLYLOC_STAT_SNPRINTF].calls == 0);
+
+    polyloc_stats_enable(was_on);
 }
 
 TEST_CASE("sprintf_l tests", "[sprintf]")
@@ -256,6 +434,13 @@ TEST_CASE("sprintf_l tests", "[sprintf]")
         REQUIRE(poly_sprintf_l(buffer, "%d  %600s", ploc, 3, "abc") == 603);
     }
 
+    SECTION("output larger than 4K") {
+        std::vector<char> big(10000, '\3');
+        REQUIRE(poly_sprintf_l(big.data(), "%9000s|%d", ploc, "abc", 42) == 9003);
+        REQUIRE(string_view(big.data()).size() == 9003);
+        REQUIRE(string_view(big.data()).substr(8994) == "   abc|42");
+    }
+
     SECTION("% as last char") {
         int retval = poly_sprintf_l(buffer, "%", ploc, 42);
         string_view result = buffer;
@@ -263,7 +448,7 @@ TEST_CASE("sprintf_l tests", "[sprintf]")
         REQUIRE(result == "");
     }
 
-    TEST_FMT("42.1540000", "%#0-10.3f", 42.1539);
+    TEST_FMT("42.154    ", "%#0-10.3f", 42.1539);
 }
 
 TEST_CASE("Size handler bug", "[bug][.]")
@@ -330,6 +515,313 @@ TEST_CASE("snprintf_l tests", "[snprintf]") {
     }
 }
 
+TEST_CASE("asprintf_l tests", "[asprintf]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    char* str = nullptr;
+
+    SECTION("short") {
+        REQUIRE(poly_asprintf_l(&str, "%s=%.2f", loc.get(), "pi", 3.14159) == 7);
+        REQUIRE(string_view(str) == "pi=3.14");
+    }
+
+    SECTION("longer than the stack buffer") {
+        REQUIRE(poly_asprintf_l(&str, "%s|%5000d", loc.get(), "x", 7) == 5002);
+        REQUIRE(string_view(str) == "x|" + std::string(4999, ' ') + "7");
+    }
+
+    SECTION("empty") {
+        REQUIRE(poly_asprintf_l(&str, "", loc.get()) == 0);
+        REQUIRE(string_view(str) == "");
+    }
+
+    SECTION("invalid format") {
+        str = (char*)"sentinel";
+        REQUIRE(poly_asprintf_l(&str, "%1$d %d", loc.get(), 1, 2) == -1);
+        REQUIRE(str == nullptr);
+    }
+
+    free(str);
+}
+
+TEST_CASE("poly_buffer", "[buffer]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    char storage[16];
+    auto buf = std::unique_ptr<poly_buffer, decltype(&poly_free_buffer)>(poly_new_buffer(storage, sizeof storage), &poly_free_buffer);
+    REQUIRE(buf);
+    REQUIRE(string_view(poly_buffer_data(buf.get())) == "");
+
+    SECTION("appends in the caller's storage") {
+        REQUIRE(poly_buffer_printf_l(buf.get(), "%s=", loc.get(), "key") == 4);
+        REQUIRE(poly_buffer_printf_l(buf.get(), "%d", loc.get(), 42) == 2);
+        REQUIRE(poly_buffer_data(buf.get()) == storage);
+        REQUIRE(string_view(poly_buffer_data(buf.get())) == "key=42");
+        REQUIRE(poly_buffer_size(buf.get()) == 6);
+    }
+
+    SECTION("grows past it and keeps the capacity") {
+        std::string expected;
+        for (int i = 0; i < 100; i++) {
+            poly_buffer_printf_l(buf.get(), "[%d:%.1f]", loc.get(), i, i / 2.0);
+            expected += '[' + std::to_string(i) + ':' + std::to_string(i / 2) + (i % 2 ? ".5]" : ".0]");
+        }
+        REQUIRE(string_view(poly_buffer_data(buf.get())) == expected);
+
+        auto const data = poly_buffer_data(buf.get());
+        poly_buffer_clear(buf.get());
+        REQUIRE(poly_buffer_size(buf.get()) == 0);
+
+        for (int i = 0; i < 100; i++)
+            poly_buffer_printf_l(buf.get(), "[%d:%.1f]", loc.get(), i, i / 2.0);
+        REQUIRE(poly_buffer_data(buf.get()) == data);
+        REQUIRE(string_view(poly_buffer_data(buf.get())) == expected);
+    }
+
+    SECTION("w/o storage") {
+        auto heap = std::unique_ptr<poly_buffer, decltype(&poly_free_buffer)>(poly_new_buffer(NULL, 0), &poly_free_buffer);
+        REQUIRE(string_view(poly_buffer_data(heap.get())) == "");
+        REQUIRE(poly_buffer_printf_l(heap.get(), "%s", loc.get(), "abc") == 3);
+        REQUIRE(string_view(poly_buffer_data(heap.get())) == "abc");
+    }
+
+    SECTION("0 capacity storage") {
+        char none[1] = { 'x' };
+        auto empty = std::unique_ptr<poly_buffer, decltype(&poly_free_buffer)>(poly_new_buffer(none, 0), &poly_free_buffer);
+        REQUIRE(string_view(poly_buffer_data(empty.get())) == "");
+        REQUIRE(none[0] == 'x');
+        REQUIRE(poly_buffer_printf_l(empty.get(), "%d", loc.get(), 12) == 2);
+        REQUIRE(string_view(poly_buffer_data(empty.get())) == "12");
+        REQUIRE(none[0] == 'x');
+    }
+}
+
+TEST_CASE("fprintf_l tests", "[fprintf]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    auto file = std::unique_ptr<FILE, decltype(&fclose)>(tmpfile(), &fclose);
+    REQUIRE(file);
+
+    // the whole contents of 'file'
+    auto contents = [&] {
+        std::string str(size_t(ftell(file.get())), '\0');
+        rewind(file.get());
+        str.resize(fread(&str[0], 1, str.size(), file.get()));
+        return str;
+    };
+
+    SECTION("returns the bytes written, not the file offset") {
+        fputs("header\n", file.get());
+        REQUIRE(poly_fprintf_l(file.get(), "%s=%d\n", loc.get(), "x", 42) == 5);
+        REQUIRE(contents() == "header\nx=42\n");
+    }
+
+    SECTION("output larger than the sink's buffer") {
+        REQUIRE(poly_fprintf_l(file.get(), "%3000d|", loc.get(), 1) == 3001);
+        REQUIRE(contents() == std::string(2999, ' ') + "1|");
+    }
+
+    SECTION("lines from several threads don't interleave") {
+        const std::string line(1500, 'a');
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t] {
+                for (int i = 0; i < 50; i++)
+                    poly_fprintf_l(file.get(), "%d:%s\n", loc.get(), t, line.c_str());
+            });
+        }
+        for (auto& th : threads)
+            th.join();
+
+        auto all = contents();
+        size_t lines = 0;
+        for (size_t pos = 0; pos < all.size(); lines++) {
+            auto end = all.find('\n', pos);
+            REQUIRE(all.compare(pos + 2, end - pos - 2, line) == 0);
+            pos = end + 1;
+        }
+        REQUIRE(lines == 200);
+    }
+}
+
+TEST_CASE("dprintf_l tests", "[dprintf]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    auto file = std::unique_ptr<FILE, decltype(&fclose)>(tmpfile(), &fclose);
+    REQUIRE(file);
+    int fd = fileno(file.get());
+
+    // what reached the file so far
+    auto contents = [&] {
+        std::string str(8192, '\0');
+        fseek(file.get(), 0, SEEK_SET);
+        str.resize(fread(&str[0], 1, str.size(), file.get()));
+        return str;
+    };
+
+    SECTION("direct") {
+        REQUIRE(poly_dprintf_l(fd, "%s=%.1f\n", loc.get(), "x", 0.5) == 6);
+        REQUIRE(poly_dprintf_l(fd, "%2000d|", loc.get(), 1) == 2001);
+        REQUIRE(contents() == "x=0.5\n" + std::string(1999, ' ') + "1|");
+    }
+
+    SECTION("batched") {
+        REQUIRE(poly_dprintf_batch(64) == 0);
+
+        REQUIRE(poly_dprintf_l(fd, "line %d\n", loc.get(), 1) == 7);
+        REQUIRE(poly_dprintf_l(fd, "line %d\n", loc.get(), 2) == 7);
+        REQUIRE(contents().empty());
+
+        REQUIRE(poly_dprintf_flush() == 0);
+        REQUIRE(contents() == "line 1\nline 2\n");
+
+        // going over the threshold writes the batch along w/ the call
+        poly_dprintf_l(fd, "%s", loc.get(), "queued ");
+        poly_dprintf_l(fd, "%70s", loc.get(), "big\n");
+        REQUIRE(contents().size() == 14 + 7 + 70);
+
+        poly_dprintf_l(fd, "last\n", loc.get());
+        REQUIRE(poly_dprintf_batch(0) == 64);
+        REQUIRE(contents().size() == 14 + 7 + 70 + 5);
+    }
+
+    SECTION("huge threshold") {
+        REQUIRE(poly_dprintf_batch((size_t)-1) == 0);
+        REQUIRE(poly_dprintf_l(fd, "line %d\n", loc.get(), 1) == 7);
+        REQUIRE(contents().empty());
+
+        REQUIRE(poly_dprintf_batch(0) == (size_t)-1);
+        REQUIRE(contents() == "line 1\n");
+    }
+
+    SECTION("unflushed output is dropped at thread exit") {
+        // by then the fd may have been closed, or reused for something else
+        std::thread([&] {
+            poly_dprintf_batch(64);
+            poly_dprintf_l(fd, "lost\n", loc.get());
+        }).join();
+
+        REQUIRE(contents().empty());
+    }
+}
+
+TEST_CASE("Compiled formats", "[compiled][snprintf]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    char_buffer<128> buffer;
+
+    SECTION("compiled handle") {
+        auto fmt = poly_compile_format("%s=%5.2f %d%% [%-4x]");
+        REQUIRE(fmt);
+
+        for (int i = 0; i < 3; i++) {
+            int ret = poly_snprintf_compiled_l(buffer, 128, fmt, loc.get(), "pi", 3.14159, 50 + i, 255u);
+            string_view result = buffer;
+            CAPTURE(i, ret);
+            REQUIRE(result == "pi= 3.14 5" + std::to_string(i) + "% [ff  ]");
+        }
+
+        REQUIRE(poly_snprintf_compiled_l(buffer, 4, fmt, loc.get(), "pi", 3.14159, 50, 255u) == 19);
+        REQUIRE(string_view(buffer) == "pi=");
+
+        poly_free_format(fmt);
+    }
+
+    SECTION("same address, different format") {
+        char fmt[32] = "first %d";
+        poly_snprintf_l(buffer, 128, fmt, loc.get(), 1);
+        REQUIRE(string_view(buffer) == "first 1");
+
+        std::snprintf(fmt, sizeof fmt, "second %%s");
+        poly_snprintf_l(buffer, 128, fmt, loc.get(), "2");
+        REQUIRE(string_view(buffer) == "second 2");
+    }
+}
+
+TEST_CASE("Positional arguments", "[positional][snprintf]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    char_buffer<128> buffer;
+
+    SECTION("reordered") {
+        poly_snprintf_l(buffer, 128, "%2$s has %1$d files, %1$#x", loc.get(), 26, "disk");
+        REQUIRE(string_view(buffer) == "disk has 26 files, 0x1a");
+
+        poly_snprintf_l(buffer, 128, "[%3$*1$.*2$f] %4$lld", loc.get(), 8, 2, 3.14159, -1234567890123LL);
+        REQUIRE(string_view(buffer) == "[    3.14] -1234567890123");
+    }
+
+    SECTION("compiled handle") {
+        auto fmt = poly_compile_format("%2$s=%1$.1f");
+        REQUIRE(fmt);
+        poly_snprintf_compiled_l(buffer, 128, fmt, loc.get(), 2.5, "k");
+        REQUIRE(string_view(buffer) == "k=2.5");
+        poly_free_format(fmt);
+    }
+
+    SECTION("unused arguments are taken as int") {
+        poly_snprintf_l(buffer, 128, "%3$s", loc.get(), 1, 2, "third");
+        REQUIRE(string_view(buffer) == "third");
+    }
+
+    SECTION("invalid") {
+        errno = 0;
+        REQUIRE(poly_snprintf_l(buffer, 128, "%1$d %d", loc.get(), 1, 2) == -1);
+        REQUIRE(errno == EINVAL);
+        REQUIRE(poly_snprintf_l(buffer, 128, "%1$d %1$f", loc.get(), 1) == -1);
+    }
+
+    SECTION("compile-time format") {
+        auto end = red::polyloc::format_to(buffer.data(), loc.get(), POLYLOC_FMT("%2$s-%1$03d-%2$s"), 7, "x");
+        REQUIRE(string_view(buffer.data(), end - buffer.data()) == "x-007-x");
+    }
+}
+
+TEST_CASE("Compile-time formats", "[format_to]")
+{
+    using red::polyloc::format_to;
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, "C", NULL));
+    char buffer[128];
+
+    SECTION("conversions") {
+        auto end = format_to(buffer, loc.get(), POLYLOC_FMT("%s=%5.2f %d%% [%-4x] %c"), "pi", 3.14159, 50, 255u, 'z');
+        REQUIRE(string_view(buffer, end - buffer) == "pi= 3.14 50% [ff  ] z");
+
+        end = format_to(buffer, loc.get(), POLYLOC_FMT("%*d|%.*s|%hhd|%s"), -4, 7, 2, std::string("abc"), 255, (const char*)nullptr);
+        REQUIRE(string_view(buffer, end - buffer) == "7   |ab|-1|(null)");
+    }
+
+    SECTION("same output as printf") {
+        char expected[128];
+        poly_snprintf_l(expected, sizeof expected, "%+08d %#o %e %g %a %p", loc.get(), -42, 8u, 1e-5, 0.1, 1.0, (void*)buffer);
+
+        auto end = format_to(buffer, loc.get(), POLYLOC_FMT("%+08d %#o %e %g %a %p"), -42, 8u, 1e-5, 0.1, 1.0, (void*)buffer);
+        REQUIRE(string_view(buffer, end - buffer) == expected);
+    }
+
+    SECTION("output iterator") {
+        std::string out;
+        format_to(std::back_inserter(out), loc.get(), POLYLOC_FMT("%s"), std::string(1000, 'x'));
+        format_to(std::back_inserter(out), loc.get(), POLYLOC_FMT("|%ls"), L"wide");
+        REQUIRE(out == std::string(1000, 'x') + "|wide");
+    }
+
+    SECTION("std::string") {
+        using red::polyloc::format;
+        REQUIRE(format(loc.get(), POLYLOC_FMT("%s=%d"), "n", 5) == "n=5");
+        REQUIRE(format(loc.get(), POLYLOC_FMT("%s|%2000d"), "x", 7) == "x|" + std::string(1999, ' ') + "7");
+    }
+
+    SECTION("decimal comma") {
+        auto pt_br = locale_ptr(poly_newlocale(POLY_ALL_MASK, COMMA_LC.c_str(), NULL));
+        CAPTURE(COMMA_LC);
+
+        auto end = format_to(buffer, pt_br.get(), POLYLOC_FMT("%.2f"), 3.14159);
+        REQUIRE(string_view(buffer, end - buffer) == "3,14");
+    }
+}
+
 TEST_CASE("PI to string", "[pi][snprintf]")
 {
     const auto PI = 3.141592653;
@@ -378,6 +870,202 @@ TEST_CASE("string to PI", "[pi][strtod]")
 
 }
 
+TEST_CASE("strtod edge cases", "[strtod]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL));
+    char* end;
+
+    SECTION("endptr") {
+        auto str = "  -2.5e3xyz";
+        REQUIRE(poly_strtod_l(str, &end, loc.get()) == -2500.0);
+        REQUIRE(end == str + 8);
+
+        str = "1e+";
+        REQUIRE(poly_strtod_l(str, &end, loc.get()) == 1.0);
+        REQUIRE(end == str + 1);
+
+        str = "abc";
+        REQUIRE(poly_strtod_l(str, &end, loc.get()) == 0.0);
+        REQUIRE(end == str);
+    }
+
+    SECTION("hex, inf and nan") {
+        auto str = "0x1.8p1";
+        REQUIRE(poly_strtod_l(str, &end, loc.get()) == 3.0);
+        REQUIRE(end == str + 7);
+
+        str = "0xg";
+        REQUIRE(poly_strtod_l(str, &end, loc.get()) == 0.0);
+        REQUIRE(end == str + 1);
+
+        str = "-Infinity";
+        REQUIRE(poly_strtod_l(str, &end, loc.get()) == -HUGE_VAL);
+        REQUIRE(end == str + 9);
+
+        str = "nan(123)";
+        REQUIRE(std::isnan(poly_strtod_l(str, &end, loc.get())));
+        REQUIRE(end == str + 8);
+    }
+
+    SECTION("out of range") {
+        errno = 0;
+        REQUIRE(poly_strtod_l("1e999", NULL, loc.get()) == HUGE_VAL);
+        REQUIRE(errno == ERANGE);
+
+        errno = 0;
+        REQUIRE(poly_strtod_l("-1e-999", NULL, loc.get()) == 0.0);
+        REQUIRE(errno == ERANGE);
+    }
+
+    SECTION("float and long double") {
+        REQUIRE(poly_strtof_l("0.1", NULL, loc.get()) == 0.1f);
+        REQUIRE(poly_strtold_l("0.1", NULL, loc.get()) == 0.1l);
+
+        errno = 0;
+        REQUIRE(poly_strtof_l("1e39", NULL, loc.get()) == HUGE_VALF);
+        REQUIRE(errno == ERANGE);
+    }
+}
+
+TEST_CASE("Bulk parsing", "[strtod][bulk]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL));
+    string_view csv = "1.5,-2, 3e2 \r\nx, ,0x10\n7,8";
+    double out[8];
+    unsigned char errors[1] = { 0xff };
+    const char* end;
+
+    auto n = poly_parse_doubles_l(csv.data(), csv.size(), ',', out, 8, errors, &end, loc.get());
+    REQUIRE(n == 8);
+    REQUIRE(end == csv.data() + csv.size());
+    REQUIRE(errors[0] == 0x18); // "x" and " "
+
+    REQUIRE(out[0] == 1.5);
+    REQUIRE(out[1] == -2.0);
+    REQUIRE(out[2] == 300.0);
+    REQUIRE(std::isnan(out[3]));
+    REQUIRE(std::isnan(out[4]));
+    REQUIRE(out[5] == 16.0);
+    REQUIRE(out[7] == 8.0);
+
+    SECTION("resuming") {
+        n = poly_parse_doubles_l(csv.data(), csv.size(), ',', out, 2, NULL, &end, loc.get());
+        REQUIRE(n == 2);
+        REQUIRE(string_view(end) == " 3e2 \r\nx, ,0x10\n7,8");
+    }
+}
+
+TEST_CASE("strtol family", "[strtol]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL));
+    char* end;
+
+    SECTION("base detection") {
+        REQUIRE(poly_strtol_l(" -0x1fz", &end, 0, loc.get()) == -31);
+        REQUIRE(*end == 'z');
+        REQUIRE(poly_strtol_l("0755", NULL, 0, loc.get()) == 493);
+        REQUIRE(poly_strtol_l("0x1f", NULL, 16, loc.get()) == 31);
+        REQUIRE(poly_strtol_l("zz", NULL, 36, loc.get()) == 1295);
+
+        auto str = "0xg";
+        REQUIRE(poly_strtoul_l(str, &end, 16, loc.get()) == 0);
+        REQUIRE(end == str + 1);
+    }
+
+    SECTION("range") {
+        errno = 0;
+        REQUIRE(poly_strtoll_l("-9223372036854775808", NULL, 10, loc.get()) == INT64_MIN);
+        REQUIRE(poly_strtoull_l("18446744073709551615", NULL, 10, loc.get()) == UINT64_MAX);
+        REQUIRE(poly_strtoull_l("-1", NULL, 10, loc.get()) == UINT64_MAX);
+        REQUIRE(errno == 0);
+
+        REQUIRE(poly_strtoll_l("9223372036854775808", NULL, 10, loc.get()) == INT64_MAX);
+        REQUIRE(errno == ERANGE);
+
+        errno = 0;
+        REQUIRE(poly_strtoull_l("18446744073709551616", NULL, 10, loc.get()) == UINT64_MAX);
+        REQUIRE(errno == ERANGE);
+    }
+
+    SECTION("no conversion") {
+        auto str = " +x";
+        REQUIRE(poly_strtol_l(str, &end, 10, loc.get()) == 0);
+        REQUIRE(end == str);
+
+        errno = 0;
+        REQUIRE(poly_strtol_l("10", NULL, 1, loc.get()) == 0);
+        REQUIRE(errno == EINVAL);
+    }
+}
+
+TEST_CASE("scanf family", "[sscanf]")
+{
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, POINT_LC.c_str(), NULL));
+
+    SECTION("conversions") {
+        int i = 0, n = 0;
+        unsigned x = 0;
+        double d = 0;
+        char word[16] = {}, set[16] = {};
+
+        auto ret = poly_sscanf_l(" 42 0x1F 2.5e1 word abc-d%", "%d %x %lf %15s %15[a-c]%*c%n",
+                                 loc.get(), &i, &x, &d, word, set, &n);
+        REQUIRE(ret == 5);
+        REQUIRE(i == 42);
+        REQUIRE(x == 31);
+        REQUIRE(d == 25.0);
+        REQUIRE(string_view(word) == "word");
+        REQUIRE(string_view(set) == "abc");
+        REQUIRE(n == 24);
+    }
+
+    SECTION("failures") {
+        int a = 0, b = 0;
+        REQUIRE(poly_sscanf_l("12x", "%dy%d", loc.get(), &a, &b) == 1);
+        REQUIRE(poly_sscanf_l("x", "%d", loc.get(), &a) == 0);
+        REQUIRE(poly_sscanf_l("   ", "%d", loc.get(), &a) == EOF);
+    }
+
+    SECTION("FILE") {
+        auto file = std::unique_ptr<FILE, decltype(&fclose)>(tmpfile(), &fclose);
+        REQUIRE(file);
+        fputs("10 2.5 rest", file.get());
+        rewind(file.get());
+
+        int i = 0;
+        float f = 0;
+        REQUIRE(poly_fscanf_l(file.get(), "%d%f", loc.get(), &i, &f) == 2);
+        REQUIRE(i == 10);
+        REQUIRE(f == 2.5f);
+        REQUIRE(fgetc(file.get()) == ' ');
+    }
+
+    SECTION("compiled") {
+        auto fmt = poly_compile_scan_format("%d-%lf");
+        REQUIRE(fmt);
+
+        int i = 0;
+        double d = 0;
+        REQUIRE(poly_sscanf_compiled_l("3-0.25", fmt, loc.get(), &i, &d) == 2);
+        REQUIRE(i == 3);
+        REQUIRE(d == 0.25);
+
+        char buffer[8];
+        REQUIRE(poly_snprintf_compiled_l(buffer, sizeof buffer, fmt, loc.get(), 1, 2.0) == -1);
+        REQUIRE(errno == EINVAL);
+        poly_free_format(fmt);
+    }
+
+    SECTION("decimal comma") {
+        auto pt_br = locale_ptr(poly_newlocale(POLY_ALL_MASK, COMMA_LC.c_str(), NULL));
+        CAPTURE(COMMA_LC);
+
+        double d = 0;
+        REQUIRE(poly_sscanf_l("3,25", "%lf", pt_br.get(), &d) == 1);
+        REQUIRE(d == 3.25);
+    }
+}
+
 using namespace std::literals;
 
 TEST_CASE("Wide strings", "[wide]")
@@ -403,11 +1091,111 @@ TEST_CASE("Wide strings", "[wide]")
         CAPTURE(ret);
         REQUIRE(expected == result);
     }
+    SECTION("width and precision count bytes") {
+        auto expected = u8"[  áé|á|€]"s;
+        ret = poly_snprintf_l(buffer, 128, "[%6ls|%.3ls|%lc]", loc.get(), L"áé", L"áé", (wint_t)L'€');
+        string_view result = buffer;
+        CAPTURE(ret);
+        REQUIRE(expected == result);
+    }
+
+}
+
+TEST_CASE("Wide printf", "[wide][swprintf]")
+{
+    auto locname = "en_US.utf8";
+    INFO("[!] this test requires '"<<locname<<"' locale");
+
+    auto loc = locale_ptr(poly_newlocale(POLY_ALL_MASK, locname, NULL));
+    wchar_t buffer[64];
+    int ret;
+
+    SECTION("numbers") {
+        ret = poly_swprintf_l(buffer, 64, L"%5d|%-4x|%.2f|%e", loc.get(), 42, 255u, 3.14159, 1e-10);
+        CAPTURE(ret);
+        REQUIRE(std::wstring(buffer) == L"   42|ff  |3.14|1.000000e-10");
+        REQUIRE(ret == 28);
+    }
+    SECTION("narrow and wide strings") {
+        ret = poly_swprintf_l(buffer, 64, L"[%ls|%4s|%.1s|%c]", loc.get(), L"€", u8"áé", u8"áé", 'x');
+        CAPTURE(ret);
+        REQUIRE(std::wstring(buffer) == L"[€|  áé|á|x]");
+    }
+    SECTION("truncation is an error") {
+        ret = poly_swprintf_l(buffer, 4, L"%d", loc.get(), 12345);
+        REQUIRE(ret == -1);
+        REQUIRE(std::wstring(buffer) == L"123");
+    }
+    SECTION("decimal comma") {
+        auto pt_br = locale_ptr(poly_newlocale(POLY_ALL_MASK, COMMA_LC.c_str(), NULL));
+        poly_swprintf_l(buffer, 64, L"%.4f", pt_br.get(), 3.141592653);
+        CAPTURE(COMMA_LC);
+        REQUIRE(std::wstring(buffer) == L"3,1416");
 
+        wchar_t* end;
+        REQUIRE(poly_wcstod_l(L"3,1416;", &end, pt_br.get()) == 3.1416);
+        REQUIRE(*end == L';');
+    }
+    SECTION("wcstod") {
+        wchar_t* end;
+        REQUIRE(poly_wcstod_l(L" -2.5e3x", &end, loc.get()) == -2500.0);
+        REQUIRE(*end == L'x');
+        REQUIRE(poly_wcstod_l(L"0x1p-3", &end, loc.get()) == 0.125);
+        REQUIRE(*end == L'\0');
+    }
+    SECTION("scanf of invalid UTF-8") {
+        // each invalid byte is a U+FFFD of its own, counted against the width
+        wchar_t wc[2] = { L'-', L'-' };
+        int n = 0;
+        REQUIRE(poly_sscanf_l("\x80\x80""A", "%lc%n", loc.get(), wc, &n) == 1);
+        REQUIRE(wc[0] == 0xFFFD);
+        REQUIRE(wc[1] == L'-');
+        REQUIRE(n == 1);
+
+        wchar_t two[3] = { L'-', L'-', L'-' };
+        REQUIRE(poly_sscanf_l("\xC3\xA9\x80\x80", "%2lc%n", loc.get(), two, &n) == 1);
+        REQUIRE(std::wstring(two, 3) == L"\u00E9\uFFFD-");
+        REQUIRE(n == 3);
+
+        wchar_t str[5] = { L'-', L'-', L'-', L'-', L'-' };
+        REQUIRE(poly_sscanf_l("\x80\x80\x80\x80\x80", "%3ls", loc.get(), str) == 1);
+        REQUIRE(std::wstring(str, 5) == std::wstring(3, wchar_t(0xFFFD)) + L'\0' + L'-');
+    }
 }
 
 
 #include "impl/printf_fmt.hpp"
+#include "impl/printf.hpp"
+#include <cstdarg>
+#include <sstream>
+
+static int ostream_printf(std::ostream& os, const char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    int r = red::polyloc::do_printf(fmt, os, va);
+    va_end(va);
+    return r;
+}
+
+TEST_CASE("ostream printf", "[ostream]")
+{
+    struct comma_numpunct : std::numpunct<char> {
+        char do_decimal_point() const override { return ','; }
+    };
+
+    std::ostringstream os;
+    os.imbue(std::locale(std::locale::classic(), new comma_numpunct));
+
+    // the stream's locale is snapshotted once and reused, until it changes
+    for (int i = 0; i < 3; i++)
+        REQUIRE(ostream_printf(os, "%.1f|", 0.5) == 4);
+    REQUIRE(os.str() == "0,5|0,5|0,5|");
+
+    os.imbue(std::locale::classic());
+    ostream_printf(os, "%.1f", 0.5);
+    REQUIRE(os.str() == "0,5|0,5|0,5|0.5");
+}
 
 TEST_CASE("printf tokenizer", "[token][.]")
 {